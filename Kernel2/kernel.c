@@ -6,6 +6,8 @@
  */ 
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <util/atomic.h>
 
 #include "kernel.h"
@@ -18,6 +20,16 @@
 extern void __attribute__ ((naked)) schedule();
 extern void init_system_timer();
 extern void init_serial();
+extern uint8_t held_priority(uint8_t tid);
+#ifdef POWER_GATE_UNUSED
+extern void power_gate_unused();
+#endif
+#ifdef TIMER_THREAD
+extern void timer_daemon();
+#endif
+#ifdef DEFER_THREAD
+extern void defer_worker();
+#endif
 
 /****************************************************************************
 *	Local function declarations
@@ -25,15 +37,92 @@ extern void init_serial();
 
 void push_pthread(uint8_t tid, PTHREAD func);
 void copy_stack(uint8_t *, uint8_t *, volatile uint8_t **);
+void paint_stack(uint8_t *canary_ptr, uint8_t *base);
+void measure_stack(uint8_t *canary_ptr, uint8_t *base, 
+				   stack_usage_struct *usage);
+void __attribute__ ((naked)) isr_stack_call();
+uint8_t *alloc_stack(uint16_t size);
+bool select_thread();
+bool switch_needed();
+void set_cur_prio(uint8_t prio);
+void change_priority(uint8_t tid, uint8_t prio);
+uint8_t top_waiter(thread_msk_t waiters);
+bool in_isr();
+void wait_block(thread_msk_t *waiters, uint16_t timeout);
+bool wait_result();
+void wait_wake(uint8_t tid);
+void wake_yield();
+void update_ready(uint8_t tid);
+thread_msk_t tid_to_msk(uint8_t tid);
+uint8_t msk_to_tid(thread_msk_t msk);
+void update_system_time();
+void program_system_timer();
+uint32_t time_us();
+void wake_list_insert(uint8_t *head, uint8_t tid, uint32_t wake_time);
+uint8_t wake_list_expire(uint8_t tid, uint32_t now);
+void wake_insert(uint8_t tid, uint32_t wake_time);
+void wake_insert_us(uint8_t tid, uint32_t wake_time);
+void wake_remove(uint8_t tid);
+void wake_expire();
+uint8_t select_sleep_mode();
 
-// macro to initialize a thread's control structure and stack canary
-#define THREAD_INIT(tid, stack, stack_size)	\
+/****************************************************************************
+*	Local data
+****************************************************************************/
+
+// index of the most significant set bit of each byte value
+const uint8_t msb_lut[256] PROGMEM =
+{
+	0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+	5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7
+};
+
+// macro to initialize a thread's control structure, priority and stack canary
+#define THREAD_INIT(tid, stack, stack_size, prio)	\
 		kernel_data.thread_ctrl_tbl[tid].stack_ptr = stack + stack_size - 1; \
 		kernel_data.thread_ctrl_tbl[tid].stack_base = stack + stack_size - 1;\
 		kernel_data.thread_ctrl_tbl[tid].canary_ptr = stack;				 \
-		*(kernel_data.thread_ctrl_tbl[tid].canary_ptr) = CANARY;			 \
+		if (stack_size)														 \
+			*(kernel_data.thread_ctrl_tbl[tid].canary_ptr) = CANARY;		 \
 		kernel_data.thread_ctrl_tbl[tid].entry_pnt							 \
-		= (PTHREAD) uninitialized_thread_error;
+		= (PTHREAD) uninitialized_thread_error;								 \
+		kernel_data.thread_ctrl_tbl[tid].priority = prio;					 \
+		kernel_data.thread_ctrl_tbl[tid].base_priority = prio;
+
+/****************************************************************************
+*	ISR definitions
+****************************************************************************/
+
+/*
+ *	Timer 2 compare match A ISR
+ *
+ *	Set to run once per millisecond, or at the next thread wakeup in 
+ *	tickless builds. Advances the system clock and wakes any delayed 
+ *	threads whose wake time has been reached. In the preemptive kernel a 
+ *	woken thread with a higher priority than the interrupted thread runs 
+ *	as the ISR returns, rather than at the end of the time slice.
+ */
+KERNEL_ISR(TIMER2_COMPA_vect)
+{
+	update_system_time();
+	wake_expire();
+	program_system_timer();
+	wake_yield();
+}
 
 /****************************************************************************
 *	Kernel function definitions
@@ -49,31 +138,131 @@ void init()
 	ATOMIC_BLOCK(ATOMIC_FORCEON)
 	{
 		// initialize the thread control structure and stack canary for 
-		// each thread
-		THREAD_INIT(THREAD0, kernel_data.stacks.stack0, T0_STACKSZ);
-		THREAD_INIT(THREAD1, kernel_data.stacks.stack1, T1_STACKSZ);
-		THREAD_INIT(THREAD2, kernel_data.stacks.stack2, T2_STACKSZ);
-		THREAD_INIT(THREAD3, kernel_data.stacks.stack3, T3_STACKSZ);
-		THREAD_INIT(THREAD4, kernel_data.stacks.stack4, T4_STACKSZ);
-		THREAD_INIT(THREAD5, kernel_data.stacks.stack5, T5_STACKSZ);
-		THREAD_INIT(THREAD6, kernel_data.stacks.stack6, T6_STACKSZ);
-		THREAD_INIT(THREAD7, kernel_data.stacks.stack7, T7_STACKSZ);
+		// each thread, with the C++ thread table these are initialized 
+		// by kernel::thread_table before init is called
+#		ifndef CPP_THREAD_TABLE
+		THREAD_INIT(THREAD0, kernel_data.stacks.stack0, T0_STACKSZ
+					, T0_PRIORITY);
+		THREAD_INIT(THREAD1, kernel_data.stacks.stack1, T1_STACKSZ
+					, T1_PRIORITY);
+		THREAD_INIT(THREAD2, kernel_data.stacks.stack2, T2_STACKSZ
+					, T2_PRIORITY);
+		THREAD_INIT(THREAD3, kernel_data.stacks.stack3, T3_STACKSZ
+					, T3_PRIORITY);
+		THREAD_INIT(THREAD4, kernel_data.stacks.stack4, T4_STACKSZ
+					, T4_PRIORITY);
+		THREAD_INIT(THREAD5, kernel_data.stacks.stack5, T5_STACKSZ
+					, T5_PRIORITY);
+		THREAD_INIT(THREAD6, kernel_data.stacks.stack6, T6_STACKSZ
+					, T6_PRIORITY);
+		THREAD_INIT(THREAD7, kernel_data.stacks.stack7, T7_STACKSZ
+					, T7_PRIORITY);
+#		if MAX_THREADS > 8
+		THREAD_INIT(THREAD8, kernel_data.stacks.stack8, T8_STACKSZ
+					, T8_PRIORITY);
+		THREAD_INIT(THREAD9, kernel_data.stacks.stack9, T9_STACKSZ
+					, T9_PRIORITY);
+		THREAD_INIT(THREAD10, kernel_data.stacks.stack10, T10_STACKSZ
+					, T10_PRIORITY);
+		THREAD_INIT(THREAD11, kernel_data.stacks.stack11, T11_STACKSZ
+					, T11_PRIORITY);
+		THREAD_INIT(THREAD12, kernel_data.stacks.stack12, T12_STACKSZ
+					, T12_PRIORITY);
+		THREAD_INIT(THREAD13, kernel_data.stacks.stack13, T13_STACKSZ
+					, T13_PRIORITY);
+		THREAD_INIT(THREAD14, kernel_data.stacks.stack14, T14_STACKSZ
+					, T14_PRIORITY);
+		THREAD_INIT(THREAD15, kernel_data.stacks.stack15, T15_STACKSZ
+					, T15_PRIORITY);
+#		endif
+#		if MAX_THREADS > 16
+		THREAD_INIT(THREAD16, kernel_data.stacks.stack16, T16_STACKSZ
+					, T16_PRIORITY);
+		THREAD_INIT(THREAD17, kernel_data.stacks.stack17, T17_STACKSZ
+					, T17_PRIORITY);
+		THREAD_INIT(THREAD18, kernel_data.stacks.stack18, T18_STACKSZ
+					, T18_PRIORITY);
+		THREAD_INIT(THREAD19, kernel_data.stacks.stack19, T19_STACKSZ
+					, T19_PRIORITY);
+		THREAD_INIT(THREAD20, kernel_data.stacks.stack20, T20_STACKSZ
+					, T20_PRIORITY);
+		THREAD_INIT(THREAD21, kernel_data.stacks.stack21, T21_STACKSZ
+					, T21_PRIORITY);
+		THREAD_INIT(THREAD22, kernel_data.stacks.stack22, T22_STACKSZ
+					, T22_PRIORITY);
+		THREAD_INIT(THREAD23, kernel_data.stacks.stack23, T23_STACKSZ
+					, T23_PRIORITY);
+		THREAD_INIT(THREAD24, kernel_data.stacks.stack24, T24_STACKSZ
+					, T24_PRIORITY);
+		THREAD_INIT(THREAD25, kernel_data.stacks.stack25, T25_STACKSZ
+					, T25_PRIORITY);
+		THREAD_INIT(THREAD26, kernel_data.stacks.stack26, T26_STACKSZ
+					, T26_PRIORITY);
+		THREAD_INIT(THREAD27, kernel_data.stacks.stack27, T27_STACKSZ
+					, T27_PRIORITY);
+		THREAD_INIT(THREAD28, kernel_data.stacks.stack28, T28_STACKSZ
+					, T28_PRIORITY);
+		THREAD_INIT(THREAD29, kernel_data.stacks.stack29, T29_STACKSZ
+					, T29_PRIORITY);
+		THREAD_INIT(THREAD30, kernel_data.stacks.stack30, T30_STACKSZ
+					, T30_PRIORITY);
+		THREAD_INIT(THREAD31, kernel_data.stacks.stack31, T31_STACKSZ
+					, T31_PRIORITY);
+#		endif
+#		endif /* CPP_THREAD_TABLE */
+		
+		// the scheduler and interrupt stack starts below the frames of 
+		// init's callers, which stay in use once init returns
+		kernel_data.isr_stack_top = *(uint8_t **)STACK_POINTER;
+		if (kernel_data.isr_stack_top <= (uint8_t *) ISR_STACK_BOTTOM)
+		{
+			stack_overflow();
+		}
 		
+		// paint thread 0's stack while still running on the startup stack, 
+		// the other stacks are painted by new
+		paint_stack(kernel_data.thread_ctrl_tbl[THREAD0].canary_ptr
+				  , kernel_data.thread_ctrl_tbl[THREAD0].stack_base);
 		// copy the stack to the thread 0 stack and set the stack pointer 
 		// register to thread0's stack pointer
 		copy_stack(GCC_STACK_BASE, *(uint8_t **)STACK_POINTER
 				, &(kernel_data.thread_ctrl_tbl[THREAD0].stack_ptr));
 		*STACK_POINTER = kernel_data.thread_ctrl_tbl[THREAD0].stack_ptr;
 		
-		// initialize the disable status to disable all but thread  0
-		kernel_data.schedule_ctrl.disable_status = 
-			THREAD1_MSK | THREAD2_MSK | THREAD3_MSK | THREAD4_MSK 
-		  | THREAD5_MSK | THREAD6_MSK | THREAD7_MSK;
-		// initialize the delay_status so no threads are delayed
+		// the startup stack below init's callers is now free to become the 
+		// scheduler and interrupt stack
+		*(uint8_t *) ISR_STACK_BOTTOM = CANARY;
+		paint_stack((uint8_t *) ISR_STACK_BOTTOM, kernel_data.isr_stack_top);
+		
+		// initialize the disable status to disable all but thread  0 and 
+		// mark the other threads as not running
+		kernel_data.schedule_ctrl.disable_status = (thread_msk_t) ~THREAD0_MSK;
+		kernel_data.schedule_ctrl.exit_status = (thread_msk_t) ~THREAD0_MSK;
+		// initialize the delay_status and wakeup list so no threads are 
+		// delayed
 		kernel_data.schedule_ctrl.delay_status = 0x00;
+		kernel_data.schedule_ctrl.wake_head = NO_THREAD;
+		kernel_data.schedule_ctrl.us_wake_head = NO_THREAD;
 		// initialize the current thread and current thread mask to thread0
 		kernel_data.schedule_ctrl.cur_thread_id = THREAD0;
 		kernel_data.schedule_ctrl.cur_thread_msk = THREAD0_MSK;
+		kernel_data.schedule_ctrl.yield_tid = NO_THREAD;
+		// build the ready table from the initial status
+		for (uint8_t tid = 0; tid < MAX_THREADS; ++tid)
+		{
+			update_ready(tid);
+		}
+		
+		#	ifdef TIMER_THREAD
+		new(TIMER_THREAD, timer_daemon, true);
+		#	endif /* TIMER_THREAD */
+		#	ifdef DEFER_THREAD
+		new(DEFER_THREAD, defer_worker, true);
+		#	endif /* DEFER_THREAD */
+		#	ifdef POWER_GATE_UNUSED
+		power_gate_unused();
+		#	endif /* POWER_GATE_UNUSED */
+		set_cur_prio(kernel_data.thread_ctrl_tbl[THREAD0].priority);
 		
 		// initialize other functionality
 		
@@ -87,7 +276,8 @@ void init()
 /*
  *	Initializes a thread's stack to begin execution at a given entry point.
  *	If the given tid is the same as the calling thread, the scheduler will 
- *	be invoked and new will not return
+ *	be invoked and new will not return. Returning from the entry point 
+ *	exits the thread as thread_exit does.
  *
  *	tid:			thread id of the thread being initialized
  *	entry_point:	function pointer that will be the thread's entry point. 
@@ -103,22 +293,45 @@ void new(uint8_t tid, PTHREAD entry_point, bool enabled)
 		kernel_data.thread_ctrl_tbl[tid].stack_ptr =
 			 kernel_data.thread_ctrl_tbl[tid].stack_base;
 		kernel_data.thread_ctrl_tbl[tid].entry_pnt = entry_point;
+		kernel_data.thread_ctrl_tbl[tid].overruns = 0;
+		// push thread_exit below the entry point as a return trampoline
+		push_pthread(tid, thread_exit);
 		push_pthread(tid, entry_point);
 		kernel_data.thread_ctrl_tbl[tid].stack_ptr -= THREAD_STACK_CONTEXT_SZ;
-		// for preemptive builds initialize the status register 
-		// part of the context to have the interrupt enabled
+		// the context is restored into the registers, it must be zero so 
+		// the thread starts with r1 cleared as compiled code expects
+		for (uint8_t i = 1; i <= THREAD_STACK_CONTEXT_SZ; ++i)
+		{
+			kernel_data.thread_ctrl_tbl[tid].stack_ptr[i] = 0;
+		}
+		// a thread restarting itself is still running on its stack
+		if (kernel_data.schedule_ctrl.cur_thread_id != tid)
+		{
+			paint_stack(kernel_data.thread_ctrl_tbl[tid].canary_ptr
+					  , (uint8_t *) kernel_data.thread_ctrl_tbl[tid].stack_ptr);
+		}
+		// for preemptive builds the new context is a full context, 
+		// initialize its status register to have the interrupt enabled
 		#		ifdef PREEMPTIVE
 		*(kernel_data.thread_ctrl_tbl[tid].stack_ptr + 1) = 0x80;
+		kernel_data.thread_ctrl_tbl[tid].full_context = true;
+		kernel_data.thread_ctrl_tbl[tid].lock_cnt = 0;
+		if (kernel_data.schedule_ctrl.cur_thread_id == tid)
+		{
+			kernel_data.schedule_ctrl.lock_cnt = 0;
+		}
 		#		endif /* PREEMPTIVE */
 		
 		if (enabled)
 		{
-			kernel_data.schedule_ctrl.disable_status &= ~(1<<tid);
+			kernel_data.schedule_ctrl.disable_status &= ~tid_to_msk(tid);
 		}
 		else
 		{
-			kernel_data.schedule_ctrl.disable_status |= 1<<tid;
+			kernel_data.schedule_ctrl.disable_status |= tid_to_msk(tid);
 		}
+		kernel_data.schedule_ctrl.exit_status &= ~tid_to_msk(tid);
+		update_ready(tid);
 		
 		if (kernel_data.schedule_ctrl.cur_thread_id == tid)
 		{
@@ -127,8 +340,158 @@ void new(uint8_t tid, PTHREAD entry_point, bool enabled)
 	}
 }
 
+#if STACK_HEAP_SZ > 0
 /*
- *	enabled the specified thread allowing it to be scheduled
+ *	Initializes a thread as new does, with a stack of the given size 
+ *	allocated from the kernel stack heap. The stack is released when the 
+ *	thread exits. The thread must not be running and, once created with 
+ *	new_dynamic, must always be recreated with new_dynamic.
+ *
+ *	tid:			thread id of the thread being initialized
+ *	entry_point:	function pointer that will be the thread's entry point
+ *	stack_sz:		size of the stack in bytes including the canary
+ *	enabled:		true if the thread should be enabled when this 
+ *					function exits
+ *	returns:		false if the stack heap has no room for the stack
+ */
+bool new_dynamic(uint8_t tid, PTHREAD entry_point, uint16_t stack_sz, 
+				 bool enabled)
+{
+	uint8_t *stack;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		// release any stack the thread already has before allocating
+		kernel_data.thread_ctrl_tbl[tid].dyn_stack = false;
+		stack = alloc_stack(stack_sz);
+		if (stack)
+		{
+			kernel_data.thread_ctrl_tbl[tid].canary_ptr = stack;
+			kernel_data.thread_ctrl_tbl[tid].stack_base = stack + stack_sz - 1;
+			*stack = CANARY;
+			kernel_data.thread_ctrl_tbl[tid].dyn_stack = true;
+		}
+	}
+	
+	if (!stack)
+	{
+		return false;
+	}
+	new(tid, entry_point, enabled);
+	return true;
+}
+#endif /* STACK_HEAP_SZ */
+
+/*
+ *	Exits the current thread. Threads waiting in join for the thread are 
+ *	woken and a stack allocated by new_dynamic is released. Does not return.
+ *	Called through the return trampoline when a thread's entry point 
+ *	returns.
+ */
+void thread_exit()
+{
+	// interrupts stay disabled until the scheduler has switched away so 
+	// nothing can reuse the released stack while it is still in use
+	cli();
+	
+	uint8_t tid = kernel_data.schedule_ctrl.cur_thread_id;
+	thread_msk_t joiners = kernel_data.thread_ctrl_tbl[tid].join_msk;
+	kernel_data.thread_ctrl_tbl[tid].join_msk = 0;
+	kernel_data.schedule_ctrl.block_status &= ~joiners;
+	while (joiners)
+	{
+		uint8_t joiner = msk_to_tid(joiners);
+		joiners &= ~tid_to_msk(joiner);
+		update_ready(joiner);
+	}
+	
+	kernel_data.thread_ctrl_tbl[tid].dyn_stack = false;
+	kernel_data.schedule_ctrl.exit_status |= 
+		kernel_data.schedule_ctrl.cur_thread_msk;
+	kernel_data.schedule_ctrl.disable_status |= 
+		kernel_data.schedule_ctrl.cur_thread_msk;
+	update_ready(tid);
+	yield();
+}
+
+/*
+ *	Blocks the current thread until the given thread has exited. Returns 
+ *	immediately if the thread has already exited or was never started.
+ *
+ *	tid:	thread id of the thread to wait for
+ */
+void join(uint8_t tid)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (kernel_data.schedule_ctrl.exit_status & tid_to_msk(tid))
+		{
+			return;
+		}
+		kernel_data.thread_ctrl_tbl[tid].join_msk |= 
+			kernel_data.schedule_ctrl.cur_thread_msk;
+		kernel_data.schedule_ctrl.block_status |= 
+			kernel_data.schedule_ctrl.cur_thread_msk;
+		update_ready(kernel_data.schedule_ctrl.cur_thread_id);
+	}
+	yield();
+}
+
+/*
+ *	Delays the current thread until period milliseconds after the last 
+ *	release time, then advances the release time by the period. Unlike 
+ *	delay, the time the thread spends running does not add to its period. 
+ *	If the new release time has already passed the thread continues 
+ *	without delaying and the overrun is counted, the release times stay 
+ *	on the period so the thread catches up.
+ *
+ *	last_wake:	the last release time, initialized from get_time before 
+ *				the first call
+ *	period:		milliseconds between release times
+ */
+void delay_until(uint32_t *last_wake, uint32_t period)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		uint32_t wake_time = *last_wake + period;
+		*last_wake = wake_time;
+		update_system_time();
+		int32_t left = wake_time - kernel_data.system_time;
+		if (left <= 0)
+		{
+			if (left < 0)
+			{
+				++kernel_data.thread_ctrl_tbl[
+					kernel_data.schedule_ctrl.cur_thread_id].overruns;
+			}
+			return;
+		}
+		kernel_data.schedule_ctrl.delay_status |= 
+			kernel_data.schedule_ctrl.cur_thread_msk;
+		update_ready(kernel_data.schedule_ctrl.cur_thread_id);
+		wake_insert(kernel_data.schedule_ctrl.cur_thread_id, wake_time);
+	}
+	yield();
+}
+
+/*
+ *	Returns the number of release times delay_until has found already 
+ *	passed since the thread was created.
+ *
+ *	tid:	thread id of the thread
+ */
+uint16_t get_overruns(uint8_t tid)
+{
+	uint16_t overruns;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		overruns = kernel_data.thread_ctrl_tbl[tid].overruns;
+	}
+	return overruns;
+}
+
+/*
+ *	enabled the specified thread allowing it to be scheduled. From a 
+ *	KERNEL_ISR a higher priority thread runs as the ISR returns.
  *
  *	tid:	thread id of the thread to be enabled
  */
@@ -136,10 +499,157 @@ void enable(uint8_t tid)
 {
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		kernel_data.schedule_ctrl.disable_status &= ~(1<<tid);
+		kernel_data.schedule_ctrl.disable_status &= ~tid_to_msk(tid);
+		update_ready(tid);
+	}
+	// threads keep running until they next enter the scheduler
+	if (in_isr())
+	{
+		wake_yield();
 	}
 }
 
+/*
+ *	Returns the system time in milliseconds. Unlike reading system_time 
+ *	directly, the value is read atomically and is exact in tickless builds.
+ */
+uint32_t get_time()
+{
+	uint32_t time;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		update_system_time();
+		time = kernel_data.system_time;
+	}
+	return time;
+}
+
+/*
+ *	Returns the system time in microseconds, read atomically with the 
+ *	timer 2 counts since the last millisecond. Wraps about every 71 
+ *	minutes, so compare times by their difference. The resolution is 
+ *	USEC_PER_COUNT.
+ */
+uint32_t get_time_us()
+{
+	uint32_t time;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		update_system_time();
+		time = time_us();
+	}
+	return time;
+}
+
+/*
+ *	Delays the current thread by at least the given number of 
+ *	microseconds. The system timer compare is brought forward to wake the 
+ *	thread instead of waiting for the next millisecond. Waits shorter than 
+ *	DELAY_US_MIN are spun without giving up the processor.
+ *	The time is read rounded down to a whole timer 2 count, 
+ *	USEC_PER_COUNT microseconds or 64 with the tickless prescaler, so one 
+ *	count is added for the delay to be at least as long as requested. A 
+ *	short delay may last up to two counts longer.
+ *
+ *	delay_micros:	the minimum number of microseconds for the thread to be 
+ *	delayed
+ */
+void delay_us(uint16_t delay_micros)
+{
+	if (delay_micros < DELAY_US_MIN)
+	{
+		uint32_t start = get_time_us();
+		while (get_time_us() - start < delay_micros + USEC_PER_COUNT)
+		{
+		}
+		return;
+	}
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		kernel_data.schedule_ctrl.delay_status |= 
+			kernel_data.schedule_ctrl.cur_thread_msk;
+		update_ready(kernel_data.schedule_ctrl.cur_thread_id);
+		update_system_time();
+		wake_insert_us(kernel_data.schedule_ctrl.cur_thread_id, 
+					   time_us() + delay_micros + USEC_PER_COUNT);
+	}
+	yield();
+}
+
+/*
+ *	Sets the priority of the specified thread. The new priority takes 
+ *	effect the next time the scheduler runs. While the thread holds a 
+ *	mutex a higher priority thread waits for, it keeps running at the 
+ *	waiter's priority.
+ *
+ *	tid:		thread id of the thread
+ *	priority:	the new priority, higher values are scheduled first. Must be 
+ *				less than NUM_PRIORITIES
+ */
+void set_priority(uint8_t tid, uint8_t priority)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		kernel_data.thread_ctrl_tbl[tid].base_priority = priority;
+		change_priority(tid, held_priority(tid));
+	}
+}
+
+/*
+ *	Reports how much of a thread's stack has been used since the thread was 
+ *	created, found from the highest byte that no longer holds STACK_PAINT. 
+ *	The peak only includes a saved context if the thread was switched out 
+ *	at its deepest point, so the required size adds the larger of a 
+ *	KERNEL_ISR's ISR_THREAD_FRAME_SZ bytes and a return address plus the 
+ *	context a switch could save there. A preemptible thread can be switched 
+ *	out at any point with a full context, a cooperative one only with a 
+ *	call context. ISRs declared with ISR run entirely on the thread's stack 
+ *	and must be budgeted by hand.
+ *
+ *	tid:	thread id of the thread
+ *	usage:	filled with the thread's stack usage in bytes
+ */
+void stack_usage(uint8_t tid, stack_usage_struct *usage)
+{
+	uint8_t *canary_ptr;
+	uint8_t *base;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		canary_ptr = kernel_data.thread_ctrl_tbl[tid].canary_ptr;
+		base = kernel_data.thread_ctrl_tbl[tid].stack_base;
+	}
+	
+	measure_stack(canary_ptr, base, usage);
+	usage->context = THREAD_STACK_CONTEXT_SZ;
+#	ifdef PREEMPTIVE
+	if (kernel_data.thread_ctrl_tbl[tid].cooperative)
+	{
+		usage->context = CALL_CONTEXT_SZ;
+	}
+#	endif /* PREEMPTIVE */
+	usage->isr = RETURN_ADDR_SZ + usage->context;
+	if (usage->isr < ISR_THREAD_FRAME_SZ)
+	{
+		usage->isr = ISR_THREAD_FRAME_SZ;
+	}
+	usage->required += usage->isr;
+}
+
+/*
+ *	Reports how much of the scheduler and interrupt stack has been used 
+ *	since init. Its size is ISR_STACK_SZ less the frames of init's callers.
+ *
+ *	usage:	filled with the stack usage in bytes
+ */
+void isr_stack_usage(stack_usage_struct *usage)
+{
+	measure_stack((uint8_t *) ISR_STACK_BOTTOM, kernel_data.isr_stack_top
+				, usage);
+	usage->context = 0;
+	usage->isr = 0;
+}
+
 /****************************************************************************
 *	Local function definitions
 ****************************************************************************/
@@ -185,4 +695,768 @@ void copy_stack(uint8_t *s1_base, uint8_t *s1_ptr, volatile uint8_t **s2_ptr)
 		--s1_base;
 		--(*s2_ptr);
 	}
-}
\ No newline at end of file
+}
+
+/*
+ *	Fills a stack above the canary with STACK_PAINT so measure_stack can 
+ *	find how deep the stack has grown. The stack must not be in use
+ *
+ *	canary_ptr:	lowest byte of the stack, holding the canary
+ *	base:		highest byte of the stack
+ */
+void paint_stack(uint8_t *canary_ptr, uint8_t *base)
+{
+	uint8_t *ptr = canary_ptr + 1;
+	while (ptr <= base)
+	{
+		*ptr++ = STACK_PAINT;
+	}
+}
+
+/*
+ *	Measures a painted stack, the highest byte that no longer holds 
+ *	STACK_PAINT is the deepest the stack has grown. Fills in the size, peak 
+ *	and the required size as the peak plus the canary.
+ *
+ *	canary_ptr:	lowest byte of the stack, holding the canary
+ *	base:		highest byte of the stack
+ *	usage:		filled with the stack usage in bytes
+ */
+void measure_stack(uint8_t *canary_ptr, uint8_t *base, 
+				   stack_usage_struct *usage)
+{
+	uint8_t *ptr = canary_ptr + 1;
+	while (ptr <= base && *ptr == STACK_PAINT)
+	{
+		++ptr;
+	}
+	usage->size = base + 1 - canary_ptr;
+	usage->peak = base + 1 - ptr;
+	usage->required = usage->peak + 1;
+}
+
+/*
+ *	Runs the handler of a KERNEL_ISR, whose address is in r30:r31, on the 
+ *	scheduler and interrupt stack. The ISR has already pushed r30 and r31. 
+ *	Only the outermost ISR switches stacks, nested ISRs and ISRs taken 
+ *	while the scheduler sleeps are already on it. A flag byte under the 
+ *	saved registers records whether the stack was switched. In the 
+ *	preemptive kernel the outermost ISR enters the scheduler instead of 
+ *	returning if the handler woke a thread that should preempt the 
+ *	interrupted one. The routine is a single asm statement since its 
+ *	labels branch between the stages and the compiler must not place code 
+ *	of its own between them.
+ */
+void __attribute__ ((naked)) isr_stack_call()
+{
+	// save the registers needed to switch stacks on the thread's stack
+	asm volatile ("push r0\n\
+				   in r0, 0x3f\n\
+				   push r0\n\
+				   push r26\n\
+				   push r27\n\
+				   in r26, 0x3d\n\
+				   in r27, 0x3e\n\
+				   cpi r27, hi8(%[bottom])\n\
+				   brlo 1f\n\
+				   brne 2f\n\
+				   cpi r26, lo8(%[bottom])\n\
+				   brsh 2f\n\
+				1: sts %[thread_sp], r26\n\
+				   sts %[thread_sp]+1, r27\n\
+				   lds r26, %[top]\n\
+				   lds r27, %[top]+1\n\
+				   out 0x3e, r27\n\
+				   out 0x3d, r26\n\
+				   ldi r26, 1\n\
+				   rjmp 3f\n\
+				2: clr r26\n\
+				3: push r26\n"
+	
+				  // save the remaining caller save registers and run the 
+				  // handler
+				  "push r1\n\
+				   clr r1\n\
+				   push r18\n\
+				   push r19\n\
+				   push r20\n\
+				   push r21\n\
+				   push r22\n\
+				   push r23\n\
+				   push r24\n\
+				   push r25\n\
+				   icall\n\
+				   pop r25\n\
+				   pop r24\n\
+				   pop r23\n\
+				   pop r22\n\
+				   pop r21\n\
+				   pop r20\n\
+				   pop r19\n\
+				   pop r18\n\
+				   pop r1\n"
+	
+				  // return to the thread's stack if this ISR switched stacks
+				  "pop r26\n\
+				   tst r26\n\
+				   breq 1f\n\
+				   lds r26, %[thread_sp]\n\
+				   lds r27, %[thread_sp]+1\n\
+				   out 0x3e, r27\n\
+				   out 0x3d, r26\n"
+	
+	#	ifdef PREEMPTIVE
+				  // the outermost ISR leaves the thread's registers on its 
+				  // stack as the preemption ISR does when a switch was 
+				  // requested
+				  "lds r26, %[resched]\n\
+				   tst r26\n\
+				   breq 1f\n\
+				   clr r26\n\
+				   sts %[resched], r26\n\
+				   pop r27\n\
+				   pop r26\n\
+				   pop r0\n\
+				   out 0x3f, r0\n\
+				   pop r0\n\
+				   pop r31\n\
+				   pop r30\n\
+				   jmp save_context\n"
+	#	endif /* PREEMPTIVE */
+	
+				  "1: pop r27\n\
+				   pop r26\n\
+				   pop r0\n\
+				   out 0x3f, r0\n\
+				   pop r0\n\
+				   pop r31\n\
+				   pop r30\n\
+				   reti"
+				  :
+				  : [bottom] "i" (ISR_STACK_BOTTOM),
+				    [thread_sp] "i" (&kernel_data.isr_thread_sp),
+				    [top] "i" (&kernel_data.isr_stack_top)
+	#	ifdef PREEMPTIVE
+				  , [resched] "i" (&kernel_data.schedule_ctrl.isr_resched)
+	#	endif /* PREEMPTIVE */
+				  );
+}
+
+#if STACK_HEAP_SZ > 0
+/*
+ *	Allocates a stack from the stack heap, first fit. The candidates are the 
+ *	start of the heap and the byte after each allocated stack.
+ *	Must be called with interrupts disabled.
+ *
+ *	size:		size of the stack in bytes
+ *	returns:	pointer to the lowest byte of the stack or NULL if there is 
+ *				no room
+ */
+uint8_t *alloc_stack(uint16_t size)
+{
+	uint8_t *heap_end = kernel_data.stack_heap + STACK_HEAP_SZ;
+	
+	for (uint8_t i = 0; i <= MAX_THREADS; ++i)
+	{
+		uint8_t *start;
+		if (i == MAX_THREADS)
+		{
+			start = kernel_data.stack_heap;
+		}
+		else if (kernel_data.thread_ctrl_tbl[i].dyn_stack)
+		{
+			start = kernel_data.thread_ctrl_tbl[i].stack_base + 1;
+		}
+		else
+		{
+			continue;
+		}
+		
+		if (size > (uint16_t) (heap_end - start))
+		{
+			continue;
+		}
+		
+		// the candidate fits if it overlaps no allocated stack
+		bool fits = true;
+		for (uint8_t j = 0; j < MAX_THREADS; ++j)
+		{
+			if (kernel_data.thread_ctrl_tbl[j].dyn_stack 
+			 && kernel_data.thread_ctrl_tbl[j].canary_ptr < start + size 
+			 && kernel_data.thread_ctrl_tbl[j].stack_base >= start)
+			{
+				fits = false;
+				break;
+			}
+		}
+		if (fits)
+		{
+			return start;
+		}
+	}
+	return NULL;
+}
+#endif /* STACK_HEAP_SZ */
+
+/*
+ *	Updates the ready table entry of a thread from its disable, delay and 
+ *	block status. Must be called with interrupts disabled whenever any 
+ *	status of a thread changes.
+ *
+ *	tid:	the thread id of the thread to update
+ */
+void update_ready(uint8_t tid)
+{
+	thread_msk_t msk = tid_to_msk(tid);
+	uint8_t prio = kernel_data.thread_ctrl_tbl[tid].priority;
+	
+	if ((kernel_data.schedule_ctrl.disable_status 
+	   | kernel_data.schedule_ctrl.delay_status 
+	   | kernel_data.schedule_ctrl.block_status) & msk)
+	{
+		kernel_data.schedule_ctrl.ready_tbl[prio] &= ~msk;
+		if (!kernel_data.schedule_ctrl.ready_tbl[prio])
+		{
+			kernel_data.schedule_ctrl.ready_grp &= ~(1<<prio);
+		}
+	}
+	else
+	{
+		kernel_data.schedule_ctrl.ready_tbl[prio] |= msk;
+		kernel_data.schedule_ctrl.ready_grp |= 1<<prio;
+	}
+}
+
+/*
+ *	Returns the thread mask of a thread id. Runs in constant time for any 
+ *	MAX_THREADS, unlike a variable shift of a wide mask.
+ *
+ *	tid:	the thread id
+ */
+thread_msk_t tid_to_msk(uint8_t tid)
+{
+	thread_msk_t msk = 0;
+	((uint8_t *) &msk)[tid >> 3] = 1 << (tid & 0x07);
+	return msk;
+}
+
+/*
+ *	Returns the thread id of the highest thread set in a thread mask using 
+ *	msb_lut on its highest non zero byte. Scans up to one byte for each 8 
+ *	threads of MAX_THREADS.
+ *
+ *	msk:	the thread mask, must not be zero
+ */
+uint8_t msk_to_tid(thread_msk_t msk)
+{
+	uint8_t i = sizeof(thread_msk_t) - 1;
+	while (!((uint8_t *) &msk)[i])
+	{
+		--i;
+	}
+	return (i << 3) + pgm_read_byte(&msb_lut[((uint8_t *) &msk)[i]]);
+}
+
+/*
+ *	Selects the highest priority ready thread as the current thread. Threads 
+ *	of equal priority are selected round robin. A ready thread named by 
+ *	yield_to is selected regardless of priority. Uses the ready table and 
+ *	msb_lut, so the cost only grows with the bytes of a thread mask, not 
+ *	with the number of ready threads.
+ *	Must be called with interrupts disabled.
+ *
+ *	returns:	true if a thread was selected, false if no thread is ready
+ */
+bool select_thread()
+{
+	uint8_t prio;
+	thread_msk_t ready;
+	
+	// hand the processor to the thread named by yield_to if it is ready
+	uint8_t tid = kernel_data.schedule_ctrl.yield_tid;
+	if (tid != NO_THREAD)
+	{
+		kernel_data.schedule_ctrl.yield_tid = NO_THREAD;
+		prio = kernel_data.thread_ctrl_tbl[tid].priority;
+		ready = tid_to_msk(tid);
+		if (kernel_data.schedule_ctrl.ready_tbl[prio] & ready)
+		{
+			kernel_data.schedule_ctrl.rr_msk[prio] = ready;
+			kernel_data.schedule_ctrl.cur_thread_msk = ready;
+			kernel_data.schedule_ctrl.cur_thread_id = tid;
+			set_cur_prio(prio);
+			return true;
+		}
+	}
+	
+	uint8_t grp = kernel_data.schedule_ctrl.ready_grp;
+	if (!grp)
+	{
+		return false;
+	}
+	
+	// find the ready threads of the highest ready priority
+	prio = pgm_read_byte(&msb_lut[grp]);
+	ready = kernel_data.schedule_ctrl.ready_tbl[prio];
+	
+	// choose the lowest ready thread above the last one run at this 
+	// priority, wrapping around to the lowest ready thread
+	thread_msk_t next = 
+		ready & ~((kernel_data.schedule_ctrl.rr_msk[prio] << 1) - 1);
+	if (!next)
+	{
+		next = ready;
+	}
+	next &= -next;
+	
+	kernel_data.schedule_ctrl.rr_msk[prio] = next;
+	kernel_data.schedule_ctrl.cur_thread_msk = next;
+	kernel_data.schedule_ctrl.cur_thread_id = msk_to_tid(next);
+	set_cur_prio(prio);
+	return true;
+}
+
+/*
+ *	Checks if select_thread would select a thread other than the current 
+ *	one, so a context switch can be skipped when it would not. Counts each 
+ *	skipped switch in switch_skips.
+ *
+ *	returns:	true if a different thread would be selected
+ */
+bool switch_needed()
+{
+	if (kernel_data.schedule_ctrl.yield_tid != NO_THREAD
+	 || (kernel_data.schedule_ctrl.ready_grp 
+	   & kernel_data.schedule_ctrl.cur_hi_msk)
+	 || kernel_data.schedule_ctrl.ready_tbl[kernel_data.schedule_ctrl.cur_prio] 
+	 != kernel_data.schedule_ctrl.cur_thread_msk)
+	{
+		return true;
+	}
+	++kernel_data.schedule_ctrl.switch_skips;
+	return false;
+}
+
+/*
+ *	Changes the priority a thread is scheduled at, moving it in the ready 
+ *	table. Must be called with interrupts disabled.
+ *
+ *	tid:	the thread id of the thread
+ *	prio:	the new priority
+ */
+void change_priority(uint8_t tid, uint8_t prio)
+{
+	// remove the thread from the ready table at its old priority 
+	// then reinsert it at the new one
+	thread_msk_t msk = tid_to_msk(tid);
+	uint8_t old = kernel_data.thread_ctrl_tbl[tid].priority;
+	kernel_data.schedule_ctrl.ready_tbl[old] &= ~msk;
+	if (!kernel_data.schedule_ctrl.ready_tbl[old])
+	{
+		kernel_data.schedule_ctrl.ready_grp &= ~(1<<old);
+	}
+	kernel_data.thread_ctrl_tbl[tid].priority = prio;
+	update_ready(tid);
+	if (kernel_data.schedule_ctrl.cur_thread_id == tid)
+	{
+		set_cur_prio(prio);
+	}
+}
+
+/*
+ *	Returns the highest priority thread in a set of waiters, the highest
+ *	thread id among equal priorities.
+ *	Must be called with interrupts disabled.
+ *
+ *	waiters:	thread mask of the waiters, must not be zero
+ */
+uint8_t top_waiter(thread_msk_t waiters)
+{
+	uint8_t top = msk_to_tid(waiters);
+	waiters &= ~tid_to_msk(top);
+	while (waiters)
+	{
+		uint8_t tid = msk_to_tid(waiters);
+		waiters &= ~tid_to_msk(tid);
+		if (kernel_data.thread_ctrl_tbl[tid].priority
+		  > kernel_data.thread_ctrl_tbl[top].priority)
+		{
+			top = tid;
+		}
+	}
+	return top;
+}
+
+/*
+ *	Returns true if called from a KERNEL_ISR or the scheduler, which run 
+ *	on the scheduler and interrupt stack.
+ */
+bool in_isr()
+{
+	return *(uint8_t **)STACK_POINTER >= (uint8_t *) ISR_STACK_BOTTOM 
+		&& *(uint8_t **)STACK_POINTER <= kernel_data.isr_stack_top;
+}
+
+/*
+ *	Blocks the current thread on a kernel object until wait_wake is called 
+ *	for it or the timeout passes. The caller yields once interrupts are 
+ *	enabled and then calls wait_result.
+ *	Must be called with interrupts disabled.
+ *
+ *	waiters:	the object's mask of waiting threads
+ *	timeout:	milliseconds to wait, or WAIT_FOREVER
+ */
+void wait_block(thread_msk_t *waiters, uint16_t timeout)
+{
+	uint8_t tid = kernel_data.schedule_ctrl.cur_thread_id;
+	*waiters |= kernel_data.schedule_ctrl.cur_thread_msk;
+	kernel_data.thread_ctrl_tbl[tid].wait_msk = waiters;
+	kernel_data.thread_ctrl_tbl[tid].woken = false;
+	
+	// a timed wait is a delay that the object can cut short
+	if (timeout == WAIT_FOREVER)
+	{
+		kernel_data.schedule_ctrl.block_status |= 
+			kernel_data.schedule_ctrl.cur_thread_msk;
+	}
+	else
+	{
+		kernel_data.schedule_ctrl.delay_status |= 
+			kernel_data.schedule_ctrl.cur_thread_msk;
+		update_system_time();
+		wake_insert(tid, kernel_data.system_time + timeout);
+	}
+	update_ready(tid);
+}
+
+/*
+ *	Finishes a wait started by wait_block once the thread runs again, 
+ *	leaving the object's waiters if the wait timed out.
+ *
+ *	returns:	true if the thread was woken by the object
+ */
+bool wait_result()
+{
+	bool woken;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		uint8_t tid = kernel_data.schedule_ctrl.cur_thread_id;
+		woken = kernel_data.thread_ctrl_tbl[tid].woken;
+		if (!woken)
+		{
+			*kernel_data.thread_ctrl_tbl[tid].wait_msk &= 
+				~kernel_data.schedule_ctrl.cur_thread_msk;
+		}
+	}
+	return woken;
+}
+
+/*
+ *	Wakes a thread blocked on a kernel object by wait_block, removing it 
+ *	from the object's waiters and cancelling its timeout.
+ *	Must be called with interrupts disabled.
+ *
+ *	tid:	the thread id of the waiting thread
+ */
+void wait_wake(uint8_t tid)
+{
+	thread_msk_t msk = tid_to_msk(tid);
+	*kernel_data.thread_ctrl_tbl[tid].wait_msk &= ~msk;
+	kernel_data.thread_ctrl_tbl[tid].woken = true;
+	if (kernel_data.schedule_ctrl.delay_status & msk)
+	{
+		wake_remove(tid);
+		kernel_data.schedule_ctrl.delay_status &= ~msk;
+	}
+	kernel_data.schedule_ctrl.block_status &= ~msk;
+	update_ready(tid);
+}
+
+/*
+ *	Yields if a thread the caller woke has a higher priority than the 
+ *	current thread. A locked thread yields when it unlocks. In a KERNEL_ISR 
+ *	the preemptive kernel switches as the outermost ISR returns, unless the 
+ *	interrupted thread is cooperative, and the cooperative kernel switches 
+ *	when the scheduler next runs.
+ */
+void wake_yield()
+{
+	if (!(kernel_data.schedule_ctrl.ready_grp 
+		& kernel_data.schedule_ctrl.cur_hi_msk))
+	{
+		return;
+	}
+	#	ifdef PREEMPTIVE
+	if (kernel_data.schedule_ctrl.lock_cnt)
+	{
+		kernel_data.schedule_ctrl.preempt_pending = true;
+	}
+	else if (in_isr())
+	{
+		if (!kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].cooperative)
+		{
+			kernel_data.schedule_ctrl.isr_resched = true;
+		}
+	}
+	else
+	{
+		yield();
+	}
+	#	else
+	if (!in_isr())
+	{
+		yield();
+	}
+	#	endif /* PREEMPTIVE */
+}
+
+/*
+ *	Records the priority of the current thread used by switch_needed.
+ *
+ *	prio:	the priority of the current thread
+ */
+void set_cur_prio(uint8_t prio)
+{
+	kernel_data.schedule_ctrl.cur_prio = prio;
+	kernel_data.schedule_ctrl.cur_hi_msk = ~((2<<prio) - 1);
+}
+
+/*
+ *	Advances the system time by the timer 2 counts elapsed since the last 
+ *	update. Must be called with interrupts disabled and at least once every 
+ *	256 timer 2 counts.
+ */
+void update_system_time()
+{
+	uint8_t now = TCNT2;
+	kernel_data.system_time_us += 
+		(uint8_t) (now - kernel_data.timer_last) * USEC_PER_COUNT;
+	kernel_data.timer_last = now;
+	while (kernel_data.system_time_us >= USEC_PER_MILLIS)
+	{
+		kernel_data.system_time_us -= USEC_PER_MILLIS;
+		++kernel_data.system_time;
+	}
+}
+
+/*
+ *	Programs the timer 2 compare match A for the next millisecond boundary, 
+ *	or in tickless builds for the earliest thread wakeup no more than 
+ *	TICKLESS_MAX_COUNTS ahead. The system time must have just been updated.
+ */
+void program_system_timer()
+{
+	uint8_t counts;
+	
+	#	ifdef TICKLESS
+	counts = TICKLESS_MAX_COUNTS;
+	uint8_t tid = kernel_data.schedule_ctrl.wake_head;
+	if (tid != NO_THREAD)
+	{
+		int32_t millis = kernel_data.schedule_ctrl.wake_time[tid] 
+					   - kernel_data.system_time;
+		if (millis <= 0)
+		{
+			counts = 0;
+		}
+		else if (millis <= 
+			(uint16_t) TICKLESS_MAX_COUNTS * USEC_PER_COUNT / USEC_PER_MILLIS)
+		{
+			counts = ((uint16_t) millis * USEC_PER_MILLIS 
+				   - kernel_data.system_time_us + USEC_PER_COUNT - 1) 
+				   / USEC_PER_COUNT;
+		}
+	}
+	#	else /* TICKLESS */
+	counts = (USEC_PER_MILLIS - kernel_data.system_time_us 
+			+ USEC_PER_COUNT - 1) / USEC_PER_COUNT;
+	#	endif /* TICKLESS */
+	
+	// bring the match forward for a thread in delay_us
+	uint8_t us_tid = kernel_data.schedule_ctrl.us_wake_head;
+	if (us_tid != NO_THREAD)
+	{
+		int32_t micros = kernel_data.schedule_ctrl.wake_time[us_tid] - time_us();
+		if (micros <= 0)
+		{
+			counts = 0;
+		}
+		else if (micros < (int32_t) counts * USEC_PER_COUNT)
+		{
+			counts = ((uint16_t) micros + USEC_PER_COUNT - 1) / USEC_PER_COUNT;
+		}
+	}
+	
+	// never program a match the counter may already have passed, the 
+	// margin is measured from the counter now rather than from timer_last 
+	// since the work above takes a few counts at the larger prescalers
+	uint8_t elapsed = TCNT2 - kernel_data.timer_last;
+	if (counts < elapsed + 2)
+	{
+		counts = elapsed + 2;
+	}
+	OCR2A = kernel_data.timer_last + counts;
+}
+
+/*
+ *	Selects the deepest sleep mode the scheduler can enter when no thread 
+ *	is ready. Peripherals with power_acquire references that need the I/O 
+ *	clock keep the idle mode and a referenced ADC that is converting keeps 
+ *	the ADC noise reduction mode. Extended standby keeps the clock running 
+ *	for the system timer while a wakeup is due, which is always in a tick 
+ *	build. A tickless build with no delayed thread has no deadline to meet 
+ *	and powers down until an external interrupt, the system time does not 
+ *	advance while the timer is stopped.
+ *	Must be called with interrupts disabled.
+ *
+ *	returns:	the SMCR sleep mode bits
+ */
+uint8_t select_sleep_mode()
+{
+	if (kernel_data.power_active & SLEEP_IDLE_MODULES)
+	{
+		return SLEEP_MODE_IDLE;
+	}
+	if ((kernel_data.power_active & POWER_ADC) && (ADCSRA & (1 << ADSC)))
+	{
+		return SLEEP_MODE_ADC;
+	}
+	
+	#	ifdef TICKLESS
+	if (kernel_data.schedule_ctrl.wake_head == NO_THREAD 
+		&& kernel_data.schedule_ctrl.us_wake_head == NO_THREAD)
+	{
+		return SLEEP_MODE_PWR_DOWN;
+	}
+	#	endif /* TICKLESS */
+	return SLEEP_MODE_EXT_STANDBY;
+}
+
+/*
+ *	Returns the system time in microseconds. The system time must have 
+ *	just been updated.
+ */
+uint32_t time_us()
+{
+	return kernel_data.system_time * USEC_PER_MILLIS 
+		 + kernel_data.system_time_us;
+}
+
+/*
+ *	Inserts a thread into a wakeup list ordered by wake time. Threads with 
+ *	equal wake times wake in the order they were inserted. A thread is in 
+ *	at most one list, the lists share wake_time and wake_next.
+ *	Must be called with interrupts disabled.
+ *
+ *	head:		the head of the list
+ *	tid:		the thread id of the delayed thread
+ *	wake_time:	the time the thread is to be woken at
+ */
+void wake_list_insert(uint8_t *head, uint8_t tid, uint32_t wake_time)
+{
+	uint8_t *link = head;
+	while (*link != NO_THREAD 
+	   && (int32_t) (kernel_data.schedule_ctrl.wake_time[*link] - wake_time) <= 0)
+	{
+		link = &kernel_data.schedule_ctrl.wake_next[*link];
+	}
+	kernel_data.schedule_ctrl.wake_time[tid] = wake_time;
+	kernel_data.schedule_ctrl.wake_next[tid] = *link;
+	*link = tid;
+}
+
+/*
+ *	Wakes every thread at the front of a wakeup list whose wake time has 
+ *	been reached. Must be called with interrupts disabled.
+ *
+ *	tid:		the head of the list
+ *	now:		the current time in the list's units
+ *	returns:	the new head of the list
+ */
+uint8_t wake_list_expire(uint8_t tid, uint32_t now)
+{
+	while (tid != NO_THREAD 
+	   && (int32_t) (kernel_data.schedule_ctrl.wake_time[tid] - now) <= 0)
+	{
+		kernel_data.schedule_ctrl.delay_status &= ~tid_to_msk(tid);
+		update_ready(tid);
+		tid = kernel_data.schedule_ctrl.wake_next[tid];
+	}
+	return tid;
+}
+
+/*
+ *	Inserts a thread into the wakeup list ordered by wake time.
+ *	Must be called with interrupts disabled.
+ *
+ *	tid:		the thread id of the delayed thread
+ *	wake_time:	the system time the thread is to be woken at
+ */
+void wake_insert(uint8_t tid, uint32_t wake_time)
+{
+	wake_list_insert(&kernel_data.schedule_ctrl.wake_head, tid, wake_time);
+	
+	// the timer must be reprogrammed if the thread now wakes first
+	#	ifdef TICKLESS
+	if (kernel_data.schedule_ctrl.wake_head == tid)
+	{
+		update_system_time();
+		program_system_timer();
+	}
+	#	endif /* TICKLESS */
+}
+
+/*
+ *	Removes a thread from the wakeup list if it is on it.
+ *	Must be called with interrupts disabled.
+ *
+ *	tid:	the thread id of the delayed thread
+ */
+void wake_remove(uint8_t tid)
+{
+	uint8_t *link = &kernel_data.schedule_ctrl.wake_head;
+	while (*link != NO_THREAD)
+	{
+		if (*link == tid)
+		{
+			*link = kernel_data.schedule_ctrl.wake_next[tid];
+			return;
+		}
+		link = &kernel_data.schedule_ctrl.wake_next[*link];
+	}
+}
+
+/*
+ *	Inserts a thread into the delay_us wakeup list and brings the system 
+ *	timer compare forward if the thread now wakes first.
+ *	Must be called with interrupts disabled.
+ *
+ *	tid:		the thread id of the delayed thread
+ *	wake_time:	the system time in microseconds the thread is to be woken at
+ */
+void wake_insert_us(uint8_t tid, uint32_t wake_time)
+{
+	wake_list_insert(&kernel_data.schedule_ctrl.us_wake_head, tid, wake_time);
+	if (kernel_data.schedule_ctrl.us_wake_head == tid)
+	{
+		update_system_time();
+		program_system_timer();
+	}
+}
+
+/*
+ *	Wakes every delayed thread whose wake time has been reached. The system 
+ *	time must have just been updated. Must be called with interrupts 
+ *	disabled.
+ */
+void wake_expire()
+{
+	kernel_data.schedule_ctrl.wake_head = 
+		wake_list_expire(kernel_data.schedule_ctrl.wake_head, 
+						 kernel_data.system_time);
+	if (kernel_data.schedule_ctrl.us_wake_head != NO_THREAD)
+	{
+		kernel_data.schedule_ctrl.us_wake_head = 
+			wake_list_expire(kernel_data.schedule_ctrl.us_wake_head, time_us());
+	}
+}
@@ -24,7 +24,14 @@
 /****************************************************************************
 *	Define thread and stack constants
 ****************************************************************************/
-#define MAX_THREADS 8
+
+#if MAX_THREADS != 8 && MAX_THREADS != 16 && MAX_THREADS != 32
+#	error "MAX_THREADS must be 8, 16 or 32"
+#endif
+
+#if EVENT_FLAGS_BITS != 8 && EVENT_FLAGS_BITS != 16
+#	error "EVENT_FLAGS_BITS must be 8 or 16"
+#endif
 
 #define THREAD0 0
 #define THREAD1 1
@@ -34,6 +41,38 @@
 #define THREAD5 5
 #define THREAD6 6
 #define THREAD7 7
+#define THREAD8 8
+#define THREAD9 9
+#define THREAD10 10
+#define THREAD11 11
+#define THREAD12 12
+#define THREAD13 13
+#define THREAD14 14
+#define THREAD15 15
+#define THREAD16 16
+#define THREAD17 17
+#define THREAD18 18
+#define THREAD19 19
+#define THREAD20 20
+#define THREAD21 21
+#define THREAD22 22
+#define THREAD23 23
+#define THREAD24 24
+#define THREAD25 25
+#define THREAD26 26
+#define THREAD27 27
+#define THREAD28 28
+#define THREAD29 29
+#define THREAD30 30
+#define THREAD31 31
+
+#if defined(TIMER_THREAD) && TIMER_THREAD >= MAX_THREADS
+#	error "TIMER_THREAD must be less than MAX_THREADS"
+#endif
+
+#if defined(DEFER_THREAD) && DEFER_THREAD >= MAX_THREADS
+#	error "DEFER_THREAD must be less than MAX_THREADS"
+#endif
 
 #define THREAD0_MSK 0b00000001
 #define THREAD1_MSK 0b00000010
@@ -43,15 +82,68 @@
 #define THREAD5_MSK 0b00100000
 #define THREAD6_MSK 0b01000000
 #define THREAD7_MSK 0b10000000
-
+#define THREAD8_MSK 0x00000100UL
+#define THREAD9_MSK 0x00000200UL
+#define THREAD10_MSK 0x00000400UL
+#define THREAD11_MSK 0x00000800UL
+#define THREAD12_MSK 0x00001000UL
+#define THREAD13_MSK 0x00002000UL
+#define THREAD14_MSK 0x00004000UL
+#define THREAD15_MSK 0x00008000UL
+#define THREAD16_MSK 0x00010000UL
+#define THREAD17_MSK 0x00020000UL
+#define THREAD18_MSK 0x00040000UL
+#define THREAD19_MSK 0x00080000UL
+#define THREAD20_MSK 0x00100000UL
+#define THREAD21_MSK 0x00200000UL
+#define THREAD22_MSK 0x00400000UL
+#define THREAD23_MSK 0x00800000UL
+#define THREAD24_MSK 0x01000000UL
+#define THREAD25_MSK 0x02000000UL
+#define THREAD26_MSK 0x04000000UL
+#define THREAD27_MSK 0x08000000UL
+#define THREAD28_MSK 0x10000000UL
+#define THREAD29_MSK 0x20000000UL
+#define THREAD30_MSK 0x40000000UL
+#define THREAD31_MSK 0x80000000UL
+
+#define NO_THREAD 0xff
+
+#define NUM_PRIORITIES 8
+
+// timeouts of blocking kernel calls in milliseconds, NO_WAIT returns at 
+// once and WAIT_FOREVER never times out
+#define NO_WAIT 0
+#define WAIT_FOREVER 0xffff
+
+// event_wait options, wake when any or all of the flags are set and 
+// whether to clear the flags that woke the thread
+#define EVENT_ANY 0b00
+#define EVENT_ALL 0b01
+#define EVENT_CLEAR 0b10
 
 #define CANARY 0xaa
+// stacks are painted with this pattern to find their high water mark
+#define STACK_PAINT 0x55
 
 #define STACK_POINTER ((volatile uint8_t **)(0x5d))
 #define GCC_STACK_BASE (uint8_t *) RAMEND
 
+// the scheduler and interrupt stack holds its canary at this address, the 
+// top is wherever main's stack ended when init was called
+#define ISR_STACK_BOTTOM (RAMEND - ISR_STACK_SZ + 1)
+// bytes a KERNEL_ISR leaves on the interrupted thread's stack, the return 
+// address plus r0, SREG, r26, r27, r30 and r31
+#define ISR_THREAD_FRAME_SZ 9
+// bytes of a return address, the program counter is 3 bytes
+#define RETURN_ADDR_SZ 3
+
+// context saved when a thread calls into the scheduler, the callee save 
+// registers only
+#define CALL_CONTEXT_SZ 18
+
 #ifndef PREEMPTIVE
-#define THREAD_STACK_CONTEXT_SZ 18
+#define THREAD_STACK_CONTEXT_SZ CALL_CONTEXT_SZ
 #else
 #define THREAD_STACK_CONTEXT_SZ 33
 #endif	/* PREEMPTIVE */
@@ -62,7 +154,16 @@
 
 #define USEC_PER_MILLIS 1000
 
-#ifdef PREEMPTIVE
+#ifdef TICKLESS
+
+// the slowest prescaler lets the timer be programmed up to ~16 ms ahead
+#	define PRESCALLER_SELECT 0b111
+#	define TIMER2_PRESCALLER 1024
+#	if defined(PREEMPTIVE) && TIME_SLICE < 2*1024
+#		error "TIME_SLICE is too short for the tickless timer prescaler"
+#	endif
+
+#elif defined(PREEMPTIVE)
 
 #	if TIME_SLICE < (1<<8)*64
 #		define PRESCALLER_SELECT 0b100
@@ -87,12 +188,78 @@
 
 #endif /* PREEMPTIVE */
 
+// microseconds per timer 2 count
+#define USEC_PER_COUNT (TIMER2_PRESCALLER / (F_CPU / 1000000))
+// the furthest ahead the tickless timer is programmed, in timer 2 counts, 
+// leaving a margin before the 8 bit counter wraps
+#define TICKLESS_MAX_COUNTS 0xf0
+// delay_us spins for shorter waits, switching out and back in again takes 
+// about as long. Fixed in microseconds so a coarse tickless count does not 
+// make threads spin for hundreds of microseconds
+#define DELAY_US_MIN 32
+// timer 2 counts in a time slice of the given number of cycles, slices 
+// longer than 0xff counts are run as several compare matches
+#define SLICE_COUNTS(cycles) ((cycles) / TIMER2_PRESCALLER - 1)
+
+/****************************************************************************
+*	Define peripheral power modules
+*	The module table of PowerTest, PRR1 bits in the high byte and PRR0 
+*	bits in the low byte
+****************************************************************************/
+
+#define POWER_TIM5 0x2000
+#define POWER_TIM4 0x1000
+#define POWER_TIM3 0x0800
+#define POWER_TIM2 0x0040
+#define POWER_TIM1 0x0008
+#define POWER_TIM0 0x0020
+
+#define POWER_USART3 0x0400
+#define POWER_USART2 0x0200
+#define POWER_USART1 0x0100
+#define POWER_USART0 0x0002
+
+#define POWER_ADC 0x0001
+
+#define POWER_SPI 0x0004
+
+#define POWER_TWI 0x0080
+
+// modules power_acquire counts, timer 2 is always powered for the kernel 
+// and PRR0 bit 4 is reserved
+#define POWER_MODULES (POWER_TIM5 | POWER_TIM4 | POWER_TIM3 | POWER_TIM1 \
+					 | POWER_TIM0 | POWER_USART3 | POWER_USART2 \
+					 | POWER_USART1 | POWER_USART0 | POWER_ADC | POWER_SPI \
+					 | POWER_TWI)
+// references are kept by bit number, up to PRR1 bit 5
+#define NUM_POWER_MODULES 14
+
+// modules that stop in every sleep mode but idle, the idle mode is used 
+// while any of them has a power_acquire reference
+#define SLEEP_IDLE_MODULES (POWER_MODULES & ~POWER_ADC)
+
 #ifndef __ASSEMBLER__
 /****************************************************************************
 *	Kernel data structures
 ****************************************************************************/
 
 typedef void (*PTHREAD)();
+typedef void (*PCALLBACK)(void *);
+
+// bitmap with one bit per thread
+#if MAX_THREADS == 8
+typedef uint8_t thread_msk_t;
+#elif MAX_THREADS == 16
+typedef uint16_t thread_msk_t;
+#else
+typedef uint32_t thread_msk_t;
+#endif
+
+#if EVENT_FLAGS_BITS == 8
+typedef uint8_t event_flags_t;
+#else
+typedef uint16_t event_flags_t;
+#endif
 
 typedef struct  
 {
@@ -104,52 +271,279 @@ typedef struct
 	uint8_t stack5[T5_STACKSZ];
 	uint8_t stack6[T6_STACKSZ];
 	uint8_t stack7[T7_STACKSZ];
+#	if MAX_THREADS > 8
+	uint8_t stack8[T8_STACKSZ];
+	uint8_t stack9[T9_STACKSZ];
+	uint8_t stack10[T10_STACKSZ];
+	uint8_t stack11[T11_STACKSZ];
+	uint8_t stack12[T12_STACKSZ];
+	uint8_t stack13[T13_STACKSZ];
+	uint8_t stack14[T14_STACKSZ];
+	uint8_t stack15[T15_STACKSZ];
+#	endif
+#	if MAX_THREADS > 16
+	uint8_t stack16[T16_STACKSZ];
+	uint8_t stack17[T17_STACKSZ];
+	uint8_t stack18[T18_STACKSZ];
+	uint8_t stack19[T19_STACKSZ];
+	uint8_t stack20[T20_STACKSZ];
+	uint8_t stack21[T21_STACKSZ];
+	uint8_t stack22[T22_STACKSZ];
+	uint8_t stack23[T23_STACKSZ];
+	uint8_t stack24[T24_STACKSZ];
+	uint8_t stack25[T25_STACKSZ];
+	uint8_t stack26[T26_STACKSZ];
+	uint8_t stack27[T27_STACKSZ];
+	uint8_t stack28[T28_STACKSZ];
+	uint8_t stack29[T29_STACKSZ];
+	uint8_t stack30[T30_STACKSZ];
+	uint8_t stack31[T31_STACKSZ];
+#	endif
 } stack_struct;
 
+typedef struct mutex_struct
+{
+	uint8_t owner;						// owning thread or NO_THREAD
+	thread_msk_t waiters;				// threads blocked in mutex_lock
+	struct mutex_struct *next_held;		// next mutex held by the owner
+} mutex_struct;
+
+#define MUTEX_INITIALIZER { NO_THREAD, 0, NULL }
+
+typedef struct  
+{
+	uint16_t count;
+	thread_msk_t waiters;				// threads blocked in sem_wait
+} sem_struct;
+
+#define SEM_INITIALIZER(count) { count, 0 }
+
+typedef struct  
+{
+	event_flags_t flags;
+	thread_msk_t waiters;				// threads blocked in event_wait
+} event_struct;
+
+#define EVENT_INITIALIZER { 0, 0 }
+
+// single producer, single consumer byte ring buffer. head and tail run 
+// freely and are each written by one side only, so the sides never need 
+// to disable interrupts to move data
+typedef struct  
+{
+	uint8_t *buf;
+	uint8_t mask;						// buffer size - 1
+	volatile uint8_t head;				// written by the producer
+	volatile uint8_t tail;				// written by the consumer
+	thread_msk_t waiters;				// the consumer, if blocked in ring_read
+} ring_struct;
+
+// buf must be an array whose size is a power of 2 no larger than 128
+#define RING_INITIALIZER(buf) { buf, sizeof(buf) - 1, 0, 0, 0 }
+
+// fixed size blocks, each free block holds a pointer to the next
+typedef struct  
+{
+	uint8_t *buf;						// storage for the blocks
+	void *free;							// first free block
+	uint16_t block_sz;
+	uint8_t count;						// number of blocks
+	uint8_t free_cnt;					// number of free blocks
+	uint8_t peak;						// most blocks ever allocated at once
+	uint16_t failures;					// allocations that found no free block
+	thread_msk_t waiters;				// threads blocked in pool_alloc
+} pool_struct;
+
+// queue of message pointers, usually blocks from a pool
+typedef struct  
+{
+	void **buf;
+	uint8_t size;						// number of pointers buf holds
+	uint8_t head;						// index of the oldest message
+	uint8_t count;						// number of messages queued
+	thread_msk_t senders;				// threads blocked on a full queue
+	thread_msk_t receivers;				// threads blocked on an empty queue
+} queue_struct;
+
+// buf must be an array of void pointers
+#define QUEUE_INITIALIZER(buf) { buf, sizeof(buf) / sizeof(void *), 0, 0, 0, 0 }
+
+typedef struct timer_struct
+{
+	struct timer_struct *next;			// next active timer to expire
+	uint32_t expiry;					// system time the timer expires
+	uint16_t period;					// reload period, 0 for a one shot timer
+	bool active;
+	PCALLBACK callback;					// run by TIMER_THREAD at expiry
+	void *arg;							// argument passed to the callback
+} timer_struct;
+
+#define TIMER_INITIALIZER(callback, arg) { NULL, 0, 0, false, callback, arg }
+
+typedef struct  
+{
+	PCALLBACK callback;
+	void *arg;
+} defer_struct;
+
 typedef struct  
 {
 	volatile uint8_t *stack_ptr;
 	uint8_t *stack_base;
 	uint8_t *canary_ptr;
 	PTHREAD entry_pnt;
+	uint8_t priority;					// priority scheduled at, raised while 
+										// a held mutex has a higher waiter
+	uint8_t base_priority;				// priority set for the thread
+	mutex_struct *held;					// mutexes held, last locked first
+	mutex_struct *blocked_on;			// mutex the thread waits for
+	thread_msk_t *wait_msk;				// waiters of the kernel object the 
+										// thread waits on
+	bool woken;							// woken by the object, not the timeout
+	event_flags_t wait_flags;			// flags waited for in event_wait, then 
+										// the flags that woke the thread
+	uint8_t wait_options;				// event_wait options
+	void *wait_msg;						// message a blocked queue sender passes 
+										// or a blocked receiver is handed, or 
+										// the block a pool waiter is handed
+	thread_msk_t join_msk;				// threads waiting in join for this thread
+	bool dyn_stack;						// stack is allocated from stack_heap
+	uint16_t overruns;					// release times delay_until found 
+										// already passed
+#	ifdef PREEMPTIVE
+	bool cooperative;					// never preempted at the end of a slice
+	bool full_context;					// saved context is the full preempted 
+										// context rather than a call context
+	uint16_t time_slice;				// timer counts per slice, 0 for the 
+										// default TIME_SLICE
+	uint8_t lock_cnt;					// lock nesting depth kept while the 
+										// thread is not current
+#	endif /* PREEMPTIVE */
 } thread_ctrl_struct;
 
 typedef struct  
 {
-	uint8_t disable_status;
-	uint8_t delay_status;
-	uint16_t delay_ctrs[MAX_THREADS];
+	thread_msk_t disable_status;
+	thread_msk_t delay_status;
+	thread_msk_t block_status;			// threads waiting on another thread or 
+										// kernel object
+	thread_msk_t exit_status;			// threads that have exited or never run
+	uint32_t wake_time[MAX_THREADS];	// system time each delayed thread wakes, 
+										// in microseconds for delay_us
+	uint8_t wake_next[MAX_THREADS];		// next thread in the wakeup list
+	uint8_t wake_head;					// delayed thread that wakes first
+	uint8_t us_wake_head;				// thread in delay_us that wakes first
 	uint8_t cur_thread_id;
-	uint8_t cur_thread_msk;
+	thread_msk_t cur_thread_msk;
+	uint8_t ready_grp;					// bit n set if a priority n thread is ready
+	thread_msk_t ready_tbl[NUM_PRIORITIES];	// ready threads of each priority
+	thread_msk_t rr_msk[NUM_PRIORITIES];	// last thread scheduled at each 
+											// priority
+	uint8_t cur_prio;					// priority of the current thread
+	uint8_t cur_hi_msk;					// priorities above the current thread's
+	uint32_t switch_skips;				// context switches skipped because the 
+										// current thread was rescheduled
+	uint8_t yield_tid;					// thread handed the processor by yield_to
+#	ifdef PREEMPTIVE
+	uint16_t cur_slice;					// timer counts in the current thread's 
+										// time slice
+	uint16_t slice_left;				// timer counts of the slice left after 
+										// the next compare match
+	uint8_t lock_cnt;					// lock nesting depth of the current 
+										// thread
+	bool preempt_pending;				// the current thread would have been 
+										// preempted while locked
+	bool isr_resched;					// invoke the scheduler as the outermost 
+										// KERNEL_ISR returns
+#	endif /* PREEMPTIVE */
 } schedule_ctrl_struct;
 
 typedef struct  
 {
+#	ifndef CPP_THREAD_TABLE
 	stack_struct stacks;
+#	endif
+#	if STACK_HEAP_SZ > 0
+	uint8_t stack_heap[STACK_HEAP_SZ];	// region new_dynamic allocates from
+#	endif
 	thread_ctrl_struct thread_ctrl_tbl[MAX_THREADS];
 	schedule_ctrl_struct schedule_ctrl;
 	volatile uint32_t system_time;
+	uint16_t system_time_us;			// microseconds past system_time
+	uint8_t timer_last;					// TCNT2 when system_time was updated
+	uint8_t *isr_stack_top;				// first free byte of the empty 
+										// scheduler and interrupt stack
+	volatile uint8_t *isr_thread_sp;	// stack pointer of the thread the 
+										// outermost KERNEL_ISR interrupted
+#	ifdef TIMER_THREAD
+	timer_struct *timer_head;			// active timer that expires first
+#	endif
+	uint8_t power_refs[NUM_POWER_MODULES];	// power_acquire references to 
+											// each module, by bit number
+	uint16_t power_active;				// POWER_ modules with references
+#	ifdef DEFER_THREAD
+	defer_struct defer_queue[DEFER_QUEUE_SZ];	// work for DEFER_THREAD
+	uint8_t defer_head;					// index of the oldest work
+	uint8_t defer_count;				// number of queued work
+#	endif
 } kernel_data_struct;
 
+typedef struct  
+{
+	uint16_t size;						// stack size including the canary
+	uint16_t peak;						// most bytes ever used
+	uint16_t context;					// bytes of a saved context
+	uint16_t isr;						// bytes an ISR or a context switch adds 
+										// on top of the peak
+	uint16_t required;					// size the stack needs, peak + isr and 
+										// the canary
+} stack_usage_struct;
+
+typedef struct  
+{
+	uint16_t block_sz;
+	uint8_t count;						// number of blocks
+	uint8_t used;						// blocks allocated now
+	uint8_t peak;						// most blocks ever allocated at once
+	uint16_t failures;					// allocations that found no free block
+} pool_usage_struct;
+
+#ifdef __cplusplus
+extern kernel_data_struct kernel_data;
+extern "C" {
+#else
 kernel_data_struct kernel_data;
+#endif
 
 /****************************************************************************
 *	Kernel function prototypes
 ****************************************************************************/
 
 void init();
+#ifdef __cplusplus
+// new is a keyword in C++, the C function is bound to another name
+void new_thread(uint8_t, PTHREAD, bool) asm("new");
+#else
 void new(uint8_t, PTHREAD, bool);
+#endif
+#if STACK_HEAP_SZ > 0
+bool new_dynamic(uint8_t, PTHREAD, uint16_t, bool);
+#endif
+void thread_exit();
+void join(uint8_t);
 void delay(uint16_t);
+void delay_until(uint32_t *, uint32_t);
+uint16_t get_overruns(uint8_t);
+void yield();
+void yield_to(uint8_t);
+uint32_t get_time();
+uint32_t get_time_us();
+void delay_us(uint16_t);
 void disable(uint8_t);
 void enable(uint8_t);
-
-/****************************************************************************
-*	Cooperative kernel function prototypes
-****************************************************************************/
-
-#ifndef PREEMPTIVE
-void yield();
-#endif /* PREEMPTIVE */
+void set_priority(uint8_t, uint8_t);
+void stack_usage(uint8_t, stack_usage_struct *);
+void isr_stack_usage(stack_usage_struct *);
 
 /****************************************************************************
 *	Preemptive kernel function prototypes
@@ -158,8 +552,127 @@ void yield();
 #ifdef PREEMPTIVE
 void lock();
 void unlock();
+void set_cooperative(uint8_t, bool);
+void set_time_slice(uint8_t, uint32_t);
 #endif /* PREEMPTIVE */
 
+/****************************************************************************
+*	Mutex function prototypes
+****************************************************************************/
+
+void mutex_init(mutex_struct *);
+void mutex_lock(mutex_struct *);
+bool mutex_trylock(mutex_struct *);
+void mutex_unlock(mutex_struct *);
+
+/****************************************************************************
+*	Semaphore function prototypes
+****************************************************************************/
+
+void sem_init(sem_struct *, uint16_t);
+bool sem_wait(sem_struct *, uint16_t);
+void sem_post(sem_struct *);
+uint16_t sem_count(sem_struct *);
+
+/****************************************************************************
+*	Event flag function prototypes
+****************************************************************************/
+
+void event_init(event_struct *);
+event_flags_t event_wait(event_struct *, event_flags_t, uint8_t, uint16_t);
+void event_set(event_struct *, event_flags_t);
+void event_clear(event_struct *, event_flags_t);
+event_flags_t event_get(event_struct *);
+
+/****************************************************************************
+*	Ring buffer function prototypes
+****************************************************************************/
+
+void ring_init(ring_struct *, uint8_t *, uint8_t);
+uint8_t ring_write(ring_struct *, const uint8_t *, uint8_t);
+bool ring_put(ring_struct *, uint8_t);
+uint8_t ring_read(ring_struct *, uint8_t *, uint8_t, uint16_t);
+bool ring_get(ring_struct *, uint8_t *, uint16_t);
+uint8_t ring_count(ring_struct *);
+
+/****************************************************************************
+*	Memory pool function prototypes
+****************************************************************************/
+
+void pool_init(pool_struct *, void *, uint16_t, uint8_t);
+void *pool_alloc(pool_struct *, uint16_t);
+void pool_free(pool_struct *, void *);
+void *pool_alloc_size(pool_struct *, uint8_t, uint16_t, uint16_t);
+void pool_free_any(pool_struct *, uint8_t, void *);
+void pool_usage(pool_struct *, pool_usage_struct *);
+
+/****************************************************************************
+*	Message queue function prototypes
+****************************************************************************/
+
+void queue_init(queue_struct *, void **, uint8_t);
+bool queue_send(queue_struct *, void *, uint16_t);
+void *queue_receive(queue_struct *, uint16_t);
+uint8_t queue_count(queue_struct *);
+
+/****************************************************************************
+*	Software timer function prototypes
+****************************************************************************/
+
+#ifdef TIMER_THREAD
+void timer_init(timer_struct *, PCALLBACK, void *);
+void timer_start(timer_struct *, uint16_t, uint16_t);
+bool timer_stop(timer_struct *);
+bool timer_active(timer_struct *);
+#endif /* TIMER_THREAD */
+
+/****************************************************************************
+*	Deferred work function prototypes
+****************************************************************************/
+
+#ifdef DEFER_THREAD
+bool defer(PCALLBACK, void *);
+#endif /* DEFER_THREAD */
+
+/****************************************************************************
+*	Peripheral power function prototypes
+****************************************************************************/
+
+void power_acquire(uint16_t);
+void power_release(uint16_t);
+uint8_t power_refs(uint16_t);
+
+/****************************************************************************
+*	Interrupt declaration
+****************************************************************************/
+
+/*
+ *	Declares an ISR whose body runs on the scheduler and interrupt stack 
+ *	instead of the interrupted thread's stack, which only holds 
+ *	ISR_THREAD_FRAME_SZ bytes of it. Used in place of ISR(vector). The body 
+ *	must not enable interrupts. The ISR pushes r30 and r31 and loads the 
+ *	handler into them in one asm statement, so the compiler cannot load Z 
+ *	before the thread's values are saved. In the preemptive kernel, a 
+ *	higher priority thread the body wakes runs as soon as the outermost 
+ *	ISR returns.
+ *
+ *	KERNEL_ISR(INT0_vect)
+ *	{
+ *		...
+ *	}
+ */
+#define KERNEL_ISR(vector)												\
+	static void vector##_handler(void) __attribute__ ((used));			\
+	ISR(vector, ISR_NAKED)												\
+	{																	\
+		asm volatile ("push r30\n\t"									\
+					  "push r31\n\t"									\
+					  "ldi r30, lo8(gs(" #vector "_handler))\n\t"		\
+					  "ldi r31, hi8(gs(" #vector "_handler))\n\t"		\
+					  "jmp isr_stack_call");							\
+	}																	\
+	static void vector##_handler(void)
+
 /****************************************************************************
 *	Error function prototypes
 ****************************************************************************/
@@ -167,6 +680,10 @@ void unlock();
 void stack_overflow();
 void uninitialized_thread_error();
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __ASSEMBLER__ */
 
 #endif /* KERNEL_H_ */
\ No newline at end of file
@@ -0,0 +1,185 @@
+/*
+ * kernel.hpp
+ *
+ * C++ thread table for the kernel. Threads are declared as a list of
+ * kernel::thread types, each giving the thread id, entry point, stack size
+ * and priority. Only the declared threads get a stack and control block
+ * setup, and every address and size is a compile time constant.
+ *
+ * Define CPP_THREAD_TABLE in kernel_config.h so the kernel reserves no
+ * static stacks of its own. Thread 0 must be declared, it is the thread
+ * that calls init and may have a null entry point to continue in main.
+ * TIMER_THREAD and DEFER_THREAD must be declared when they are defined,
+ * with a null entry point since init starts them itself.
+ *
+ *	typedef kernel::thread_table<
+ *		kernel::thread<THREAD0, nullptr, 0x80>,
+ *		kernel::thread<THREAD1, control_loop, 0x60, 3>,
+ *		kernel::thread<THREAD2, logger, 0x40>
+ *	> threads;
+ *
+ *	int main()
+ *	{
+ *		threads::init();
+ *		...
+ *	}
+ */
+
+#ifndef KERNEL_HPP_
+#define KERNEL_HPP_
+
+#include "kernel.h"
+
+#ifndef CPP_THREAD_TABLE
+#	error "CPP_THREAD_TABLE must be defined in kernel_config.h to use kernel.hpp"
+#endif
+
+namespace kernel
+{
+
+/****************************************************************************
+*	Thread declaration
+****************************************************************************/
+
+/*
+ *	Declares one thread and owns its stack.
+ *
+ *	Tid:		thread id, less than MAX_THREADS
+ *	Entry:		entry point, or nullptr to leave the thread created but not
+ *				started (thread 0 continues in the caller of init)
+ *	StackSz:	stack size in bytes including the canary
+ *	Priority:	scheduling priority, less than NUM_PRIORITIES
+ *	Cooperative:	true if the thread is never preempted at the end of a 
+ *				time slice, only used by the preemptive kernel
+ *	TimeSlice:	time slice in CPU cycles, only used by the preemptive kernel
+ */
+template <uint8_t Tid, PTHREAD Entry, uint16_t StackSz
+		, uint8_t Priority = DEFAULT_PRIORITY, bool Cooperative = false
+		, uint32_t TimeSlice = TIME_SLICE>
+struct thread
+{
+	static_assert(Tid < MAX_THREADS, "thread id must be less than MAX_THREADS");
+	static_assert(Priority < NUM_PRIORITIES
+				, "priority must be less than NUM_PRIORITIES");
+	// the canary, the exit trampoline, the entry point and one context
+	static_assert(StackSz > 1 + 3 + 3 + THREAD_STACK_CONTEXT_SZ
+				, "stack is too small to hold a context");
+	static_assert(TimeSlice >= 2 * TIMER2_PRESCALLER 
+				&& SLICE_COUNTS(TimeSlice) <= 0xffff
+				, "time slice must be 2 to 0x10000 timer 2 counts");
+
+	static const uint8_t tid = Tid;
+	static const thread_msk_t msk = (thread_msk_t) 1 << Tid;
+
+	static uint8_t stack[StackSz];
+
+	// initializes the control block and canary as THREAD_INIT does
+	static void setup()
+	{
+		thread_ctrl_struct &ctrl = kernel_data.thread_ctrl_tbl[Tid];
+		ctrl.stack_ptr = stack + StackSz - 1;
+		ctrl.stack_base = stack + StackSz - 1;
+		ctrl.canary_ptr = stack;
+		stack[0] = CANARY;
+		ctrl.entry_pnt = (PTHREAD) uninitialized_thread_error;
+		ctrl.priority = Priority;
+		ctrl.base_priority = Priority;
+#		ifdef PREEMPTIVE
+		ctrl.cooperative = Cooperative;
+		ctrl.time_slice = SLICE_COUNTS(TimeSlice);
+#		endif
+	}
+
+	// starts the thread at its entry point if it has one
+	static void start()
+	{
+		// copied to a variable so a non null Entry does not warn, the test 
+		// is still resolved at compile time
+		PTHREAD entry = Entry;
+		if (entry)
+		{
+			new_thread(Tid, entry, true);
+		}
+	}
+};
+
+template <uint8_t Tid, PTHREAD Entry, uint16_t StackSz, uint8_t Priority
+		, bool Cooperative, uint32_t TimeSlice>
+uint8_t thread<Tid, Entry, StackSz, Priority, Cooperative, TimeSlice>::stack[StackSz];
+
+/****************************************************************************
+*	Thread table
+****************************************************************************/
+
+/*
+ *	A list of thread declarations. init() sets up every declared thread,
+ *	initializes the kernel and starts the threads with entry points, thread
+ *	0 last since starting the calling thread does not return.
+ */
+template <typename... Threads>
+struct thread_table;
+
+template <>
+struct thread_table<>
+{
+	static const thread_msk_t msk = 0;
+
+	static void setup() {}
+	static void start_others() {}
+	static void start_thread0() {}
+};
+
+template <typename Thread, typename... Rest>
+struct thread_table<Thread, Rest...>
+{
+	static_assert(!(Thread::msk & thread_table<Rest...>::msk)
+				, "thread id declared more than once");
+
+	static const thread_msk_t msk = Thread::msk | thread_table<Rest...>::msk;
+
+	static void setup()
+	{
+		Thread::setup();
+		thread_table<Rest...>::setup();
+	}
+
+	static void start_others()
+	{
+		if (Thread::tid != THREAD0)
+		{
+			Thread::start();
+		}
+		thread_table<Rest...>::start_others();
+	}
+
+	static void start_thread0()
+	{
+		if (Thread::tid == THREAD0)
+		{
+			Thread::start();
+		}
+		thread_table<Rest...>::start_thread0();
+	}
+
+	static void init()
+	{
+		static_assert(msk & THREAD0_MSK, "thread 0 must be declared");
+#		ifdef TIMER_THREAD
+		static_assert(msk & ((thread_msk_t) 1 << TIMER_THREAD)
+					, "TIMER_THREAD must be declared");
+#		endif
+#		ifdef DEFER_THREAD
+		static_assert(msk & ((thread_msk_t) 1 << DEFER_THREAD)
+					, "DEFER_THREAD must be declared");
+#		endif
+
+		setup();
+		::init();
+		start_others();
+		start_thread0();
+	}
+};
+
+} /* namespace kernel */
+
+#endif /* KERNEL_HPP_ */
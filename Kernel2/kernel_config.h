@@ -13,9 +13,64 @@
 *	Define scheduler parameters
 ****************************************************************************/
 
+// preemptive builds can still run single threads cooperatively, see 
+// set_cooperative
 #define PREEMPTIVE
 #define TIME_SLICE 0x4000
 
+// number of threads, 8, 16 or 32
+#define MAX_THREADS 8
+
+// define when the threads are declared with kernel::thread_table in 
+// kernel.hpp, the kernel then reserves no static stacks and the thread 
+// stack sizes and priorities below are not used
+//#define CPP_THREAD_TABLE
+
+// define to program the system timer for the next thread wakeup instead 
+// of interrupting every millisecond
+//#define TICKLESS
+
+/****************************************************************************
+*	Define thread priorities
+*	Higher values are scheduled first, threads of equal priority are 
+*	scheduled round robin. Must be less than NUM_PRIORITIES
+****************************************************************************/
+
+#define DEFAULT_PRIORITY 0
+
+#define T0_PRIORITY DEFAULT_PRIORITY
+#define T1_PRIORITY DEFAULT_PRIORITY
+#define T2_PRIORITY DEFAULT_PRIORITY
+#define T3_PRIORITY DEFAULT_PRIORITY
+#define T4_PRIORITY DEFAULT_PRIORITY
+#define T5_PRIORITY DEFAULT_PRIORITY
+#define T6_PRIORITY DEFAULT_PRIORITY
+#define T7_PRIORITY DEFAULT_PRIORITY
+#define T8_PRIORITY DEFAULT_PRIORITY
+#define T9_PRIORITY DEFAULT_PRIORITY
+#define T10_PRIORITY DEFAULT_PRIORITY
+#define T11_PRIORITY DEFAULT_PRIORITY
+#define T12_PRIORITY DEFAULT_PRIORITY
+#define T13_PRIORITY DEFAULT_PRIORITY
+#define T14_PRIORITY DEFAULT_PRIORITY
+#define T15_PRIORITY DEFAULT_PRIORITY
+#define T16_PRIORITY DEFAULT_PRIORITY
+#define T17_PRIORITY DEFAULT_PRIORITY
+#define T18_PRIORITY DEFAULT_PRIORITY
+#define T19_PRIORITY DEFAULT_PRIORITY
+#define T20_PRIORITY DEFAULT_PRIORITY
+#define T21_PRIORITY DEFAULT_PRIORITY
+#define T22_PRIORITY DEFAULT_PRIORITY
+#define T23_PRIORITY DEFAULT_PRIORITY
+#define T24_PRIORITY DEFAULT_PRIORITY
+#define T25_PRIORITY DEFAULT_PRIORITY
+#define T26_PRIORITY DEFAULT_PRIORITY
+#define T27_PRIORITY DEFAULT_PRIORITY
+#define T28_PRIORITY DEFAULT_PRIORITY
+#define T29_PRIORITY DEFAULT_PRIORITY
+#define T30_PRIORITY DEFAULT_PRIORITY
+#define T31_PRIORITY DEFAULT_PRIORITY
+
 /****************************************************************************
 *	Define stack parameters
 ****************************************************************************/
@@ -30,5 +85,66 @@
 #define T5_STACKSZ DEFAULT_STACK_SZ
 #define T6_STACKSZ DEFAULT_STACK_SZ
 #define T7_STACKSZ DEFAULT_STACK_SZ
+#define T8_STACKSZ DEFAULT_STACK_SZ
+#define T9_STACKSZ DEFAULT_STACK_SZ
+#define T10_STACKSZ DEFAULT_STACK_SZ
+#define T11_STACKSZ DEFAULT_STACK_SZ
+#define T12_STACKSZ DEFAULT_STACK_SZ
+#define T13_STACKSZ DEFAULT_STACK_SZ
+#define T14_STACKSZ DEFAULT_STACK_SZ
+#define T15_STACKSZ DEFAULT_STACK_SZ
+#define T16_STACKSZ DEFAULT_STACK_SZ
+#define T17_STACKSZ DEFAULT_STACK_SZ
+#define T18_STACKSZ DEFAULT_STACK_SZ
+#define T19_STACKSZ DEFAULT_STACK_SZ
+#define T20_STACKSZ DEFAULT_STACK_SZ
+#define T21_STACKSZ DEFAULT_STACK_SZ
+#define T22_STACKSZ DEFAULT_STACK_SZ
+#define T23_STACKSZ DEFAULT_STACK_SZ
+#define T24_STACKSZ DEFAULT_STACK_SZ
+#define T25_STACKSZ DEFAULT_STACK_SZ
+#define T26_STACKSZ DEFAULT_STACK_SZ
+#define T27_STACKSZ DEFAULT_STACK_SZ
+#define T28_STACKSZ DEFAULT_STACK_SZ
+#define T29_STACKSZ DEFAULT_STACK_SZ
+#define T30_STACKSZ DEFAULT_STACK_SZ
+#define T31_STACKSZ DEFAULT_STACK_SZ
+
+// size of the region new_dynamic allocates thread stacks from. The static 
+// stack of a thread that is only created with new_dynamic can be set to 0
+#define STACK_HEAP_SZ 0
+
+// size of the stack the scheduler and KERNEL_ISR handlers run on, taken 
+// from the top of RAM that main ran on before init. The frames of main and 
+// its callers above init stay at the top of this region
+#define ISR_STACK_SZ 0x60
+
+/****************************************************************************
+*	Define kernel object parameters
+****************************************************************************/
+
+// number of flags in an event flag group, 8 or 16
+#define EVENT_FLAGS_BITS 8
+
+// define as the id of the thread that runs software timer callbacks, which 
+// init starts. Its stack size and priority are set as for other threads, 
+// usually above the threads that use the timers
+//#define TIMER_THREAD THREAD7
+
+// define as the id of the thread that runs work deferred from ISRs, which 
+// init starts. It should have the highest priority so the preemptive 
+// kernel switches to it as the ISR that deferred the work returns
+//#define DEFER_THREAD THREAD6
+#define DEFER_QUEUE_SZ 8
+
+/****************************************************************************
+*	Define power parameters
+****************************************************************************/
+
+// define for init to gate the clock of every peripheral but the system 
+// timer, each peripheral is then powered while it has a power_acquire 
+// reference. Otherwise a peripheral is only gated once its references 
+// drop back to zero, so code that never acquires it keeps working
+//#define POWER_GATE_UNUSED
 
 #endif /* KERNEL_CONFIG_H_ */
\ No newline at end of file
@@ -10,40 +10,24 @@
 #ifndef PREEMPTIVE
 
 /****************************************************************************
-*	Local function declarations
+*	External function declarations
 ****************************************************************************/
 
-void init_system_timer();
-void __attribute__ ((naked)) schedule();
+extern bool select_thread();
+extern bool switch_needed();
+extern void update_ready(uint8_t tid);
+extern thread_msk_t tid_to_msk(uint8_t tid);
+extern void update_system_time();
+extern void program_system_timer();
+extern void wake_insert(uint8_t tid, uint32_t wake_time);
+extern uint8_t select_sleep_mode();
 
 /****************************************************************************
-*	ISR definitions
+*	Local function declarations
 ****************************************************************************/
 
-/*
- *	Timer 2 compare match A ISR
- *
- *	Set to run once per millisecond. Increments system clock and decrements 
- *	delay counters for any delayed threads.
- */
-ISR(TIMER2_COMPA_vect)
-{
-	// decrement each delay counter and clear delay_status bit if counter 
-	// reaches zero
-	uint8_t msk = 0x01;
-	for (uint8_t i = 0; i < MAX_THREADS; ++i)
-	{
-		if ((kernel_data.schedule_ctrl.delay_status & msk) 
-		&& !(--kernel_data.schedule_ctrl.delay_ctrs[i]))
-		{
-			kernel_data.schedule_ctrl.delay_status &= ~msk;
-		}
-		msk <<= 1;
-	}
-	
-	// increment system clock
-	++kernel_data.system_time;
-}
+void init_system_timer();
+void __attribute__ ((naked)) schedule();
 
 /****************************************************************************
 *	Kernel function definitions
@@ -62,7 +46,10 @@ void delay(uint16_t delay_millis)
 	{
 		kernel_data.schedule_ctrl.delay_status |= 
 			kernel_data.schedule_ctrl.cur_thread_msk;
-		kernel_data.schedule_ctrl.delay_ctrs[kernel_data.schedule_ctrl.cur_thread_id] = delay_millis;
+		update_ready(kernel_data.schedule_ctrl.cur_thread_id);
+		update_system_time();
+		wake_insert(kernel_data.schedule_ctrl.cur_thread_id, 
+					kernel_data.system_time + delay_millis);
 	}
 	yield();
 }
@@ -79,7 +66,8 @@ void disable(uint8_t tid)
 {
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		kernel_data.schedule_ctrl.disable_status |= 1<<tid;
+		kernel_data.schedule_ctrl.disable_status |= tid_to_msk(tid);
+		update_ready(tid);
 		if (kernel_data.schedule_ctrl.cur_thread_id == tid)
 		{
 			yield();
@@ -87,13 +75,37 @@ void disable(uint8_t tid)
 	}
 }
 
+/*
+ *	Hands the processor directly to the given thread, regardless of 
+ *	priority. If the thread is not ready the scheduler selects the next 
+ *	thread as yield would.
+ *
+ *	tid:	thread id of the thread to run next
+ */
+void yield_to(uint8_t tid)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		kernel_data.schedule_ctrl.yield_tid = tid;
+	}
+	yield();
+}
+
 /*
  *	Saves the current thread's context then invokes the scheduler.
+ *	Returns immediately without saving the context if the current thread 
+ *	would be scheduled again.
  *
  *	Acts as an entry point to the scheduler.
  */
 void __attribute__ ((naked)) yield()
 {
+	// only caller save registers are used before the context is saved
+	if (!switch_needed())
+	{
+		asm volatile ("ret");
+	}
+	
 	// push all callee save registers to stack
 	// any caller save registers should already be saved
 	asm volatile  ("push r2\n\
@@ -127,14 +139,15 @@ void __attribute__ ((naked)) yield()
 
 /*
  *	Initializes the system timer using timer2.
- *  Set up causes an interrupt to be triggered every millisecond
+ *  Set up causes an interrupt to be triggered every millisecond, or at the 
+ *	next thread wakeup in tickless builds
  */
 void init_system_timer()
 {
 	// initialize all needed registers
 	uint8_t com2a = 0b00;				// output pin is disconnected
 	uint8_t com2b = 0b00;				// output pin is disconnected
-	uint8_t wgm2 = 0b010;				// CTC mode with TOP at OCRA
+	uint8_t wgm2 = 0b000;				// Normal mode
 	uint8_t foc2a = 0b0;
 	uint8_t foc2b = 0b0;
 	uint8_t cs2 = PRESCALLER_SELECT;	// use prescaller selected dynamicly 
@@ -146,16 +159,19 @@ void init_system_timer()
 	TCCR2A = (com2a << COM2A0) | (com2b << COM2B0) | ((wgm2 & 0b11) << WGM20);
 	TCCR2B = (foc2a << FOC2A) | (foc2b << FOC2B) 
 		   | (((wgm2 & 0b100) >> 2) << WGM22) | (cs2 << CS20);
-	OCR2A = (F_CPU / USEC_PER_MILLIS) / TIMER2_PRESCALLER - 1;
 	TIMSK2 = (ocie2a << OCIE2A) | (ocie2b << OCIE2B) | (toie2 << TOIE2);
 	
 	// set timer to zero
+	TCNT2 = 0;
+	kernel_data.timer_last = 0;
+	kernel_data.system_time_us = 0;
 	kernel_data.system_time = 0;
+	program_system_timer();
 }
 
 /*
- *	Schedules the next thread using round robin scheduling and sleeps if 
- *	no threads are ready.
+ *	Schedules the highest priority ready thread, round robin among threads 
+ *	of equal priority, and sleeps if no threads are ready.
  *	Any context must be saved when this function is called.
  *	Will invoke the sleep function if no thread is ready and continue 
  *	to invoke it until one becomes ready.
@@ -172,33 +188,22 @@ void __attribute__ ((naked)) schedule()
 		stack_overflow();
 	}
 	
-	// compute ready status and sleep if no threads are ready
-	uint8_t ready_status;
-	do 
+	// the context is saved, run the rest of the scheduler on its own stack
+	*STACK_POINTER = kernel_data.isr_stack_top;
+	if (*(uint8_t *) ISR_STACK_BOTTOM != CANARY)
 	{
-		ready_status = kernel_data.schedule_ctrl.disable_status;
-		ready_status |= kernel_data.schedule_ctrl.delay_status;
-		ready_status = ~ready_status;
-		if (!ready_status)
-		{
-			// enter the extended standby sleep mode if no threads are ready
-			SMCR = SLEEP_MODE_EXT_STANDBY | (0b1 << SE);
-			sei();
-			asm volatile ("sleep");
-			cli();
-		}
-	} while (!ready_status);
+		stack_overflow();
+	}
 	
-	// schedule the next thread
-	do
+	// select the next thread and sleep if no threads are ready
+	while (!select_thread())
 	{
-		kernel_data.schedule_ctrl.cur_thread_id = 
-			(kernel_data.schedule_ctrl.cur_thread_id + 1) & 0x07;
-		asm volatile ("lsl %1\n\
-					   adc %1, r1"
-					  : "=r" (kernel_data.schedule_ctrl.cur_thread_msk)
-					  : "r" (kernel_data.schedule_ctrl.cur_thread_msk));
-	} while (!(kernel_data.schedule_ctrl.cur_thread_msk & ready_status));
+		// enter the deepest sleep mode that meets the next wakeup
+		SMCR = select_sleep_mode() | (0b1 << SE);
+		sei();
+		asm volatile ("sleep");
+		cli();
+	}
 	
 	// restore the scheduled thread
 	
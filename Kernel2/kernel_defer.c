@@ -0,0 +1,104 @@
+/*
+ * kernel_defer.c
+ *
+ * Work deferred from ISRs to a thread. An ISR queues a callback with defer 
+ * and returns, the callback runs on DEFER_THREAD with interrupts enabled. 
+ * In the preemptive kernel the thread runs as the ISR returns if it has a 
+ * higher priority than the interrupted thread.
+ */
+
+#include "kernel.h"
+
+#ifdef DEFER_THREAD
+
+/****************************************************************************
+*	External function declarations
+****************************************************************************/
+
+extern void update_ready(uint8_t tid);
+extern thread_msk_t tid_to_msk(uint8_t tid);
+extern void wake_yield();
+
+/****************************************************************************
+*	Deferred work function definitions
+****************************************************************************/
+
+/*
+ *	Queues a callback to run on DEFER_THREAD. Callbacks run in the order 
+ *	they were deferred. May be called from a KERNEL_ISR or a thread.
+ *
+ *	callback:	the function to run
+ *	arg:		argument passed to the callback
+ *	returns:	false if the queue already holds DEFER_QUEUE_SZ callbacks
+ */
+bool defer(PCALLBACK callback, void *arg)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (kernel_data.defer_count == DEFER_QUEUE_SZ)
+		{
+			return false;
+		}
+		uint8_t tail = kernel_data.defer_head + kernel_data.defer_count;
+		if (tail >= DEFER_QUEUE_SZ)
+		{
+			tail -= DEFER_QUEUE_SZ;
+		}
+		kernel_data.defer_queue[tail].callback = callback;
+		kernel_data.defer_queue[tail].arg = arg;
+		++kernel_data.defer_count;
+		
+		// the worker blocks whenever the queue is empty
+		kernel_data.schedule_ctrl.block_status &= ~tid_to_msk(DEFER_THREAD);
+		update_ready(DEFER_THREAD);
+	}
+	wake_yield();
+	return true;
+}
+
+/****************************************************************************
+*	Kernel function definitions
+****************************************************************************/
+
+/*
+ *	Entry point of DEFER_THREAD. Runs the queued callbacks and blocks while 
+ *	the queue is empty.
+ */
+void defer_worker()
+{
+	while (true)
+	{
+		defer_struct work;
+		bool empty;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			empty = !kernel_data.defer_count;
+			if (empty)
+			{
+				kernel_data.schedule_ctrl.block_status |= 
+					kernel_data.schedule_ctrl.cur_thread_msk;
+				update_ready(DEFER_THREAD);
+			}
+			else
+			{
+				work = kernel_data.defer_queue[kernel_data.defer_head];
+				if (++kernel_data.defer_head == DEFER_QUEUE_SZ)
+				{
+					kernel_data.defer_head = 0;
+				}
+				--kernel_data.defer_count;
+			}
+		}
+		
+		if (empty)
+		{
+			yield();
+		}
+		else
+		{
+			work.callback(work.arg);
+		}
+	}
+}
+
+#endif /* DEFER_THREAD */
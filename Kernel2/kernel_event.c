@@ -0,0 +1,182 @@
+/*
+ * kernel_event.c
+ *
+ * Event flag groups. A thread blocks until any or all of a set of flags
+ * is set, and flags can be set from KERNEL_ISRs. Setting flags wakes
+ * every thread whose wait is satisfied in one pass over the waiters.
+ */
+
+#include "kernel.h"
+
+/****************************************************************************
+*	External function declarations
+****************************************************************************/
+
+extern thread_msk_t tid_to_msk(uint8_t tid);
+extern uint8_t msk_to_tid(thread_msk_t msk);
+extern void wait_block(thread_msk_t *waiters, uint16_t timeout);
+extern bool wait_result();
+extern void wait_wake(uint8_t tid);
+extern void wake_yield();
+
+/****************************************************************************
+*	Local function declarations
+****************************************************************************/
+
+event_flags_t event_match(event_flags_t flags, event_flags_t wait_flags,
+						  uint8_t options);
+
+/****************************************************************************
+*	Event flag function definitions
+****************************************************************************/
+
+/*
+ *	Initializes an event flag group with all flags clear. Groups can also
+ *	be initialized with EVENT_INITIALIZER.
+ *
+ *	event:	the event flag group
+ */
+void event_init(event_struct *event)
+{
+	event->flags = 0;
+	event->waiters = 0;
+}
+
+/*
+ *	Waits until any or all of the given flags are set, blocking the current
+ *	thread until they are or the timeout passes. Must not be called from
+ *	an ISR.
+ *
+ *	event:		the event flag group
+ *	flags:		the flags to wait for
+ *	options:	EVENT_ANY or EVENT_ALL, or'd with EVENT_CLEAR to clear the
+ *				flags that satisfied the wait
+ *	timeout:	milliseconds to wait, NO_WAIT or WAIT_FOREVER
+ *	returns:	the waited for flags that were set, 0 if the wait timed out
+ */
+event_flags_t event_wait(event_struct *event, event_flags_t flags,
+						 uint8_t options, uint16_t timeout)
+{
+	uint8_t tid;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		event_flags_t match = event_match(event->flags, flags, options);
+		if (match)
+		{
+			if (options & EVENT_CLEAR)
+			{
+				event->flags &= ~match;
+			}
+			return match;
+		}
+		if (timeout == NO_WAIT)
+		{
+			return 0;
+		}
+		
+		tid = kernel_data.schedule_ctrl.cur_thread_id;
+		kernel_data.thread_ctrl_tbl[tid].wait_flags = flags;
+		kernel_data.thread_ctrl_tbl[tid].wait_options = options;
+		wait_block(&event->waiters, timeout);
+	}
+	yield();
+	// event_set leaves the flags that woke the thread in wait_flags
+	if (!wait_result())
+	{
+		return 0;
+	}
+	return kernel_data.thread_ctrl_tbl[tid].wait_flags;
+}
+
+/*
+ *	Sets flags in an event flag group and wakes every waiting thread whose
+ *	wait is now satisfied. Flags waited for with EVENT_CLEAR are cleared
+ *	once all the waiters have been checked, so every thread waiting on a
+ *	flag sees it. May be called from a KERNEL_ISR.
+ *
+ *	event:	the event flag group
+ *	flags:	the flags to set
+ */
+void event_set(event_struct *event, event_flags_t flags)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		event->flags |= flags;
+		
+		event_flags_t clear = 0;
+		thread_msk_t waiters = event->waiters;
+		while (waiters)
+		{
+			uint8_t tid = msk_to_tid(waiters);
+			waiters &= ~tid_to_msk(tid);
+			
+			thread_ctrl_struct *ctrl = &kernel_data.thread_ctrl_tbl[tid];
+			event_flags_t match = event_match(event->flags, ctrl->wait_flags,
+											  ctrl->wait_options);
+			if (match)
+			{
+				if (ctrl->wait_options & EVENT_CLEAR)
+				{
+					clear |= match;
+				}
+				ctrl->wait_flags = match;
+				wait_wake(tid);
+			}
+		}
+		event->flags &= ~clear;
+	}
+	wake_yield();
+}
+
+/*
+ *	Clears flags in an event flag group.
+ *
+ *	event:	the event flag group
+ *	flags:	the flags to clear
+ */
+void event_clear(event_struct *event, event_flags_t flags)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		event->flags &= ~flags;
+	}
+}
+
+/*
+ *	Returns the flags currently set in an event flag group.
+ *
+ *	event:	the event flag group
+ */
+event_flags_t event_get(event_struct *event)
+{
+	event_flags_t flags;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		flags = event->flags;
+	}
+	return flags;
+}
+
+/****************************************************************************
+*	Local function definitions
+****************************************************************************/
+
+/*
+ *	Tests whether the flags set satisfy a wait.
+ *
+ *	flags:		the flags set in the group
+ *	wait_flags:	the flags waited for
+ *	options:	the event_wait options
+ *	returns:	the waited for flags that are set if the wait is satisfied,
+ *				otherwise 0
+ */
+event_flags_t event_match(event_flags_t flags, event_flags_t wait_flags,
+						  uint8_t options)
+{
+	event_flags_t match = flags & wait_flags;
+	if ((options & EVENT_ALL) && match != wait_flags)
+	{
+		return 0;
+	}
+	return match;
+}
@@ -0,0 +1,215 @@
+/*
+ * kernel_mutex.c
+ *
+ * Mutexes that block waiting threads and apply priority inheritance. An
+ * owner runs at the priority of its highest priority waiter until it
+ * unlocks, and the mutex is handed directly to that waiter.
+ */
+
+#include "kernel.h"
+
+/****************************************************************************
+*	External function declarations
+****************************************************************************/
+
+extern void update_ready(uint8_t tid);
+extern thread_msk_t tid_to_msk(uint8_t tid);
+extern uint8_t msk_to_tid(thread_msk_t msk);
+extern void change_priority(uint8_t tid, uint8_t prio);
+extern uint8_t top_waiter(thread_msk_t waiters);
+extern void wake_yield();
+
+/****************************************************************************
+*	Local function declarations
+****************************************************************************/
+
+uint8_t held_priority(uint8_t tid);
+void inherit_priority(mutex_struct *mutex, uint8_t prio);
+void unlink_held(uint8_t tid, mutex_struct *mutex);
+
+/****************************************************************************
+*	Mutex function definitions
+****************************************************************************/
+
+/*
+ *	Initializes a mutex as unlocked. Mutexes can also be initialized with
+ *	MUTEX_INITIALIZER.
+ *
+ *	mutex:	the mutex
+ */
+void mutex_init(mutex_struct *mutex)
+{
+	mutex->owner = NO_THREAD;
+	mutex->waiters = 0;
+	mutex->next_held = NULL;
+}
+
+/*
+ *	Locks a mutex, blocking the current thread until it is unlocked. An
+ *	unlocked mutex is taken without invoking the scheduler. While the
+ *	thread waits the owner runs at least at the thread's priority. A
+ *	thread must not lock a mutex it already holds.
+ *
+ *	mutex:	the mutex
+ */
+void mutex_lock(mutex_struct *mutex)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		uint8_t tid = kernel_data.schedule_ctrl.cur_thread_id;
+		if (mutex->owner == NO_THREAD)
+		{
+			mutex->owner = tid;
+			mutex->next_held = kernel_data.thread_ctrl_tbl[tid].held;
+			kernel_data.thread_ctrl_tbl[tid].held = mutex;
+			return;
+		}
+		
+		// block until the mutex is handed to this thread by mutex_unlock
+		mutex->waiters |= kernel_data.schedule_ctrl.cur_thread_msk;
+		kernel_data.thread_ctrl_tbl[tid].blocked_on = mutex;
+		kernel_data.schedule_ctrl.block_status |=
+			kernel_data.schedule_ctrl.cur_thread_msk;
+		update_ready(tid);
+		inherit_priority(mutex, kernel_data.thread_ctrl_tbl[tid].priority);
+	}
+	yield();
+}
+
+/*
+ *	Locks a mutex if it is unlocked, without blocking.
+ *
+ *	mutex:		the mutex
+ *	returns:	true if the mutex was locked
+ */
+bool mutex_trylock(mutex_struct *mutex)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (mutex->owner != NO_THREAD)
+		{
+			return false;
+		}
+		uint8_t tid = kernel_data.schedule_ctrl.cur_thread_id;
+		mutex->owner = tid;
+		mutex->next_held = kernel_data.thread_ctrl_tbl[tid].held;
+		kernel_data.thread_ctrl_tbl[tid].held = mutex;
+	}
+	return true;
+}
+
+/*
+ *	Unlocks a mutex held by the current thread. The highest priority
+ *	waiter becomes the owner and the current thread drops back to the
+ *	priority its remaining mutexes need. Yields if the new owner has a
+ *	higher priority than the current thread.
+ *
+ *	mutex:	the mutex
+ */
+void mutex_unlock(mutex_struct *mutex)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		uint8_t tid = kernel_data.schedule_ctrl.cur_thread_id;
+		unlink_held(tid, mutex);
+		
+		if (!mutex->waiters)
+		{
+			mutex->owner = NO_THREAD;
+			if (kernel_data.thread_ctrl_tbl[tid].priority
+			 != kernel_data.thread_ctrl_tbl[tid].base_priority)
+			{
+				change_priority(tid, held_priority(tid));
+			}
+			return;
+		}
+		
+		// hand the mutex to the highest priority waiter, which inherits
+		// the priority of the waiters left behind it
+		uint8_t next = top_waiter(mutex->waiters);
+		thread_msk_t msk = tid_to_msk(next);
+		mutex->waiters &= ~msk;
+		mutex->owner = next;
+		mutex->next_held = kernel_data.thread_ctrl_tbl[next].held;
+		kernel_data.thread_ctrl_tbl[next].held = mutex;
+		kernel_data.thread_ctrl_tbl[next].blocked_on = NULL;
+		change_priority(next, held_priority(next));
+		kernel_data.schedule_ctrl.block_status &= ~msk;
+		update_ready(next);
+		
+		change_priority(tid, held_priority(tid));
+	}
+	wake_yield();
+}
+
+/****************************************************************************
+*	Local function definitions
+****************************************************************************/
+
+/*
+ *	Returns the priority a thread must run at, its own priority or that of
+ *	the highest priority thread waiting on a mutex it holds.
+ *	Must be called with interrupts disabled.
+ *
+ *	tid:	the thread id of the thread
+ */
+uint8_t held_priority(uint8_t tid)
+{
+	uint8_t prio = kernel_data.thread_ctrl_tbl[tid].base_priority;
+	for (mutex_struct *mutex = kernel_data.thread_ctrl_tbl[tid].held; mutex;
+		 mutex = mutex->next_held)
+	{
+		if (mutex->waiters)
+		{
+			uint8_t waiter_prio =
+				kernel_data.thread_ctrl_tbl[top_waiter(mutex->waiters)].priority;
+			if (waiter_prio > prio)
+			{
+				prio = waiter_prio;
+			}
+		}
+	}
+	return prio;
+}
+
+/*
+ *	Raises the owner of a mutex to at least the given priority, following
+ *	the chain of owners blocked on other mutexes.
+ *	Must be called with interrupts disabled.
+ *
+ *	mutex:	the mutex waited on
+ *	prio:	the priority of the waiting thread
+ */
+void inherit_priority(mutex_struct *mutex, uint8_t prio)
+{
+	// the chain can be no longer than the number of threads
+	for (uint8_t i = 0; i < MAX_THREADS && mutex; ++i)
+	{
+		uint8_t owner = mutex->owner;
+		if (kernel_data.thread_ctrl_tbl[owner].priority >= prio)
+		{
+			return;
+		}
+		change_priority(owner, prio);
+		mutex = kernel_data.thread_ctrl_tbl[owner].blocked_on;
+	}
+}
+
+/*
+ *	Removes a mutex from the list of mutexes a thread holds. Mutexes are
+ *	usually unlocked in the reverse order they were locked, so the mutex
+ *	is usually first.
+ *	Must be called with interrupts disabled.
+ *
+ *	tid:	the thread id of the owner
+ *	mutex:	the mutex
+ */
+void unlink_held(uint8_t tid, mutex_struct *mutex)
+{
+	mutex_struct **link = &kernel_data.thread_ctrl_tbl[tid].held;
+	while (*link != mutex)
+	{
+		link = &(*link)->next_held;
+	}
+	*link = mutex->next_held;
+}
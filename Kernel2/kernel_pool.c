@@ -0,0 +1,269 @@
+/*
+ * kernel_pool.c
+ *
+ * Fixed size block memory pools. Blocks are allocated and freed in 
+ * constant time from a list threaded through the free blocks, so pools 
+ * never fragment and may be used from KERNEL_ISRs. An array of pools in 
+ * increasing block size serves allocations of several size classes.
+ */
+
+#include "kernel.h"
+
+/****************************************************************************
+*	External function declarations
+****************************************************************************/
+
+extern uint8_t top_waiter(thread_msk_t waiters);
+extern thread_msk_t tid_to_msk(uint8_t tid);
+extern void wait_block(thread_msk_t *waiters, uint16_t timeout);
+extern bool wait_result();
+extern void wait_wake(uint8_t tid);
+extern void wake_yield();
+
+/****************************************************************************
+*	Local function declarations
+****************************************************************************/
+
+void *pool_take(pool_struct *pool);
+void *pool_wait();
+
+/****************************************************************************
+*	Memory pool function definitions
+****************************************************************************/
+
+/*
+ *	Initializes a pool with all of its blocks free.
+ *
+ *	pool:		the pool
+ *	buf:		storage for the blocks, block_sz * count bytes
+ *	block_sz:	the size of each block, at least sizeof(void *)
+ *	count:		the number of blocks
+ */
+void pool_init(pool_struct *pool, void *buf, uint16_t block_sz, uint8_t count)
+{
+	pool->buf = buf;
+	pool->block_sz = block_sz;
+	pool->count = count;
+	pool->free_cnt = count;
+	pool->peak = 0;
+	pool->failures = 0;
+	pool->waiters = 0;
+	pool->free = NULL;
+	// the list is built from the end so blocks are handed out in order
+	uint8_t *block = pool->buf + block_sz * count;
+	for (uint8_t i = 0; i < count; ++i)
+	{
+		block -= block_sz;
+		*(void **) block = pool->free;
+		pool->free = block;
+	}
+}
+
+/*
+ *	Allocates a block from a pool, blocking the current thread until one 
+ *	is freed or the timeout passes. May be called from a KERNEL_ISR if 
+ *	timeout is NO_WAIT.
+ *
+ *	pool:		the pool
+ *	timeout:	milliseconds to wait, NO_WAIT or WAIT_FOREVER
+ *	returns:	the block, NULL if the wait timed out
+ */
+void *pool_alloc(pool_struct *pool, uint16_t timeout)
+{
+	void *block;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		block = pool_take(pool);
+		if (block || timeout == NO_WAIT)
+		{
+			return block;
+		}
+		wait_block(&pool->waiters, timeout);
+	}
+	return pool_wait();
+}
+
+/*
+ *	Returns a block to the pool it was allocated from. The block is handed 
+ *	to the highest priority waiting thread if there is one. May be called 
+ *	from a KERNEL_ISR.
+ *
+ *	pool:	the pool
+ *	block:	the block
+ */
+void pool_free(pool_struct *pool, void *block)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		// a pool_alloc_size waiter waits on several pools, once another 
+		// pool has handed it a block it is only dropped from this one
+		while (pool->waiters)
+		{
+			uint8_t tid = top_waiter(pool->waiters);
+			pool->waiters &= ~tid_to_msk(tid);
+			if (!kernel_data.thread_ctrl_tbl[tid].woken)
+			{
+				kernel_data.thread_ctrl_tbl[tid].wait_msg = block;
+				wait_wake(tid);
+				block = NULL;
+				break;
+			}
+		}
+		if (block)
+		{
+			*(void **) block = pool->free;
+			pool->free = block;
+			++pool->free_cnt;
+			return;
+		}
+	}
+	wake_yield();
+}
+
+/*
+ *	Allocates a block of at least the given size from an array of pools 
+ *	in increasing block size. The smallest pool with a free block large 
+ *	enough is used. If none has one the current thread waits on every pool 
+ *	large enough until one of them frees a block or the timeout passes. 
+ *	May be called from a KERNEL_ISR if timeout is NO_WAIT.
+ *
+ *	pools:		the pools, in increasing block size
+ *	num_pools:	the number of pools
+ *	size:		the number of bytes needed
+ *	timeout:	milliseconds to wait, NO_WAIT or WAIT_FOREVER
+ *	returns:	the block, NULL if no pool is large enough or the wait 
+ *				timed out
+ */
+void *pool_alloc_size(pool_struct *pools, uint8_t num_pools, uint16_t size, 
+					  uint16_t timeout)
+{
+	uint8_t first = 0;
+	while (first < num_pools && pools[first].block_sz < size)
+	{
+		++first;
+	}
+	if (first == num_pools)
+	{
+		return NULL;
+	}
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for (uint8_t i = first; i < num_pools; ++i)
+		{
+			if (pools[i].free)
+			{
+				return pool_take(&pools[i]);
+			}
+		}
+		// counted as a failure of the size class that should have served it
+		++pools[first].failures;
+		if (timeout == NO_WAIT)
+		{
+			return NULL;
+		}
+		// the wait and its timeout belong to the first pool, the larger 
+		// pools only list the thread so their pool_free finds it
+		wait_block(&pools[first].waiters, timeout);
+		for (uint8_t i = first + 1; i < num_pools; ++i)
+		{
+			pools[i].waiters |= kernel_data.schedule_ctrl.cur_thread_msk;
+		}
+	}
+	
+	void *block = pool_wait();
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for (uint8_t i = first; i < num_pools; ++i)
+		{
+			pools[i].waiters &= ~kernel_data.schedule_ctrl.cur_thread_msk;
+		}
+	}
+	return block;
+}
+
+/*
+ *	Returns a block allocated by pool_alloc_size to the pool it came from. 
+ *	May be called from a KERNEL_ISR.
+ *
+ *	pools:		the pools passed to pool_alloc_size
+ *	num_pools:	the number of pools
+ *	block:		the block
+ */
+void pool_free_any(pool_struct *pools, uint8_t num_pools, void *block)
+{
+	for (uint8_t i = 0; i < num_pools; ++i)
+	{
+		if ((uint8_t *) block >= pools[i].buf && (uint8_t *) block 
+			< pools[i].buf + pools[i].block_sz * pools[i].count)
+		{
+			pool_free(&pools[i], block);
+			return;
+		}
+	}
+}
+
+/*
+ *	Gets the usage statistics of a pool. The peak and failures show how 
+ *	many blocks the pool really needs.
+ *
+ *	pool:	the pool
+ *	usage:	the usage statistics
+ */
+void pool_usage(pool_struct *pool, pool_usage_struct *usage)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		usage->block_sz = pool->block_sz;
+		usage->count = pool->count;
+		usage->used = pool->count - pool->free_cnt;
+		usage->peak = pool->peak;
+		usage->failures = pool->failures;
+	}
+}
+
+/****************************************************************************
+*	Local function definitions
+****************************************************************************/
+
+/*
+ *	Takes the first free block from a pool, counting a failure if there is 
+ *	none.
+ *	Must be called with interrupts disabled.
+ *
+ *	pool:		the pool
+ *	returns:	the block, NULL if the pool has no free blocks
+ */
+void *pool_take(pool_struct *pool)
+{
+	void *block = pool->free;
+	if (!block)
+	{
+		++pool->failures;
+		return NULL;
+	}
+	pool->free = *(void **) block;
+	--pool->free_cnt;
+	if (pool->count - pool->free_cnt > pool->peak)
+	{
+		pool->peak = pool->count - pool->free_cnt;
+	}
+	return block;
+}
+
+/*
+ *	Waits for a block after wait_block, returning the block pool_free 
+ *	handed to the current thread.
+ *
+ *	returns:	the block, NULL if the wait timed out
+ */
+void *pool_wait()
+{
+	yield();
+	if (!wait_result())
+	{
+		return NULL;
+	}
+	return kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id]
+		.wait_msg;
+}
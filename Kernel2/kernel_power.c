@@ -0,0 +1,129 @@
+/*
+ * kernel_power.c
+ *
+ * Reference counted peripheral power gating. Drivers and threads acquire 
+ * the modules they use and release them when done, a module's clock is 
+ * gated in PRR0 or PRR1 once nothing holds a reference to it. Modules that 
+ * were never acquired are only gated by init when POWER_GATE_UNUSED is 
+ * defined, so peripherals set up without the power functions keep their 
+ * clock by default. Referenced modules keep the scheduler out of the sleep 
+ * modes that stop them, see select_sleep_mode.
+ */
+
+#include "kernel.h"
+
+/****************************************************************************
+*	Local function declarations
+****************************************************************************/
+
+void power_gate(uint8_t bit, bool gated);
+
+/****************************************************************************
+*	Peripheral power function definitions
+****************************************************************************/
+
+/*
+ *	Takes a reference to each of the given modules, powering any module 
+ *	that had none. May be called from a KERNEL_ISR.
+ *
+ *	modules:	POWER_ module masks or'd together
+ */
+void power_acquire(uint16_t modules)
+{
+	modules &= POWER_MODULES;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for (uint8_t bit = 0; modules; ++bit, modules >>= 1)
+		{
+			if ((modules & 1) && !kernel_data.power_refs[bit]++)
+			{
+				power_gate(bit, false);
+			}
+		}
+	}
+}
+
+/*
+ *	Releases a reference to each of the given modules, gating the clock of 
+ *	any module left with none. May be called from a KERNEL_ISR.
+ *
+ *	modules:	POWER_ module masks or'd together
+ */
+void power_release(uint16_t modules)
+{
+	modules &= POWER_MODULES;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for (uint8_t bit = 0; modules; ++bit, modules >>= 1)
+		{
+			if ((modules & 1) && kernel_data.power_refs[bit]
+			 && !--kernel_data.power_refs[bit])
+			{
+				power_gate(bit, true);
+			}
+		}
+	}
+}
+
+/*
+ *	Returns the number of references to a module.
+ *
+ *	module:	a single POWER_ module mask
+ */
+uint8_t power_refs(uint16_t module)
+{
+	uint8_t bit = 0;
+	while (module > 1)
+	{
+		module >>= 1;
+		++bit;
+	}
+	return bit < NUM_POWER_MODULES ? kernel_data.power_refs[bit] : 0;
+}
+
+/****************************************************************************
+*	Kernel function definitions
+****************************************************************************/
+
+#ifdef POWER_GATE_UNUSED
+/*
+ *	Gates the clock of every module without a reference. Called by init.
+ */
+void power_gate_unused()
+{
+	for (uint8_t bit = 0; bit < NUM_POWER_MODULES; ++bit)
+	{
+		if (((POWER_MODULES >> bit) & 1) && !kernel_data.power_refs[bit])
+		{
+			power_gate(bit, true);
+		}
+	}
+}
+#endif /* POWER_GATE_UNUSED */
+
+/****************************************************************************
+*	Local function definitions
+****************************************************************************/
+
+/*
+ *	Gates or powers one module.
+ *	Must be called with interrupts disabled.
+ *
+ *	bit:	the module's bit number in the POWER_ masks
+ *	gated:	true to stop the module's clock
+ */
+void power_gate(uint8_t bit, bool gated)
+{
+	volatile uint8_t *prr = bit < 8 ? &PRR0 : &PRR1;
+	uint8_t msk = 1 << (bit & 0x07);
+	if (gated)
+	{
+		*prr |= msk;
+		kernel_data.power_active &= ~(1 << bit);
+	}
+	else
+	{
+		*prr &= ~msk;
+		kernel_data.power_active |= 1 << bit;
+	}
+}
@@ -11,55 +11,163 @@
 
 #ifdef PREEMPTIVE
 
+/****************************************************************************
+*	External function declarations
+****************************************************************************/
+
+extern bool select_thread();
+extern bool switch_needed();
+extern void update_ready(uint8_t tid);
+extern void update_system_time();
+extern void program_system_timer();
+extern void wake_insert(uint8_t tid, uint32_t wake_time);
+extern uint8_t select_sleep_mode();
+
 /****************************************************************************
 *	Local function declarations
 ****************************************************************************/
 
 void __attribute__ ((naked)) save_context();
+void __attribute__ ((naked)) save_call_context();
 void __attribute__ ((naked)) restore_context();
+void __attribute__ ((naked)) restore_call_context();
 void __attribute__ ((naked)) schedule();
+void start_slice();
 
 /****************************************************************************
 *	ISR definitions
 ****************************************************************************/
 
-/*
- *	Timer 2 compare match A ISR
- *
- *	Set to run once per millisecond. Increments system clock and decrements 
- *	delay counters for any delayed threads.
- */
-ISR(TIMER2_COMPA_vect)
-{
-	// increment the compare match to the next millisecond
-	OCR2A += (F_CPU / USEC_PER_MILLIS) / TIMER2_PRESCALLER - 1;
-	
-	// decrement delay counters and clear delay_status bit for any threads 
-	// where counter reaches zero
-	uint8_t msk = 0x01;
-	for (uint8_t i = 0; i < MAX_THREADS; ++i)
-	{
-		if ((kernel_data.schedule_ctrl.delay_status & msk) 
-		&& !(--kernel_data.schedule_ctrl.delay_ctrs[i]))
-		{
-			kernel_data.schedule_ctrl.delay_status &= ~msk;
-		}
-		msk <<= 1;
-	}
-	
-	// increment system clock
-	++kernel_data.system_time;
-}
-
 /*
  *	Timer 2 compare match B ISR.
  *
- *	Set to trigger at the end of the current threads time slice.
+ *	Set to trigger at the end of the current threads time slice, or at 
+ *	each 0xff counts of a longer slice, which only rearms the compare match.
+ *	If the current thread would be scheduled again, its time slice is 
+ *	restarted and the ISR returns without saving the context. This is the 
+ *	same test as switch_needed done using only r28 to r31. If the current 
+ *	thread is locked the preemption is left pending for unlock and the 
+ *	interrupt is disabled until then. The ISR is a single asm statement as 
+ *	its labels branch between the stages.
  */
 __attribute__ ((naked)) ISR(TIMER2_COMPB_vect)
 {
-	// invloke the scheduler at the save context entry point
-	asm volatile ("rjmp save_context");
+	// continue the time slice from this compare match if any of it is left
+	asm volatile ("push r30\n\
+				   in r30, 0x3f\n\
+				   push r30\n\
+				   push r31\n\
+				   push r29\n\
+				   push r28\n\
+				   lds r30, %[left]\n\
+				   lds r31, %[left]+1\n\
+				   lds r29, 0xb4\n\
+				   mov r28, r30\n\
+				   or r28, r31\n\
+				   brne 3f\n"
+	
+				  // the time slice is over, test if another thread is 
+				  // scheduled
+				  "lds r30, %[grp]\n\
+				   lds r31, %[hi_msk]\n\
+				   and r30, r31\n\
+				   brne 1f\n\
+				   lds r30, %[prio]\n\
+				   .if %[bytes] > 1\n\
+				   lsl r30\n\
+				   .endif\n\
+				   .if %[bytes] > 2\n\
+				   lsl r30\n\
+				   .endif\n\
+				   ldi r31, 0\n\
+				   subi r30, lo8(-(%[tbl]))\n\
+				   sbci r31, hi8(-(%[tbl]))\n\
+				   .irp i, 0, 1, 2, 3\n\
+				   .if \\i < %[bytes]\n\
+				   ld r28, Z+\n\
+				   lds r29, %[msk]+\\i\n\
+				   cp r28, r29\n\
+				   brne 1f\n\
+				   .endif\n\
+				   .endr\n"
+	
+				  // the current thread is rescheduled, count the skipped 
+				  // switch and restart its time slice from TCNT2. Then set 
+				  // OCR2B to the next compare match, at most 0xff counts on, 
+				  // and store the counts left
+				  "lds r30, %[skips]\n\
+				   lds r31, %[skips]+1\n\
+				   adiw r30, 1\n\
+				   sts %[skips], r30\n\
+				   sts %[skips]+1, r31\n\
+				   brne 2f\n\
+				   lds r30, %[skips]+2\n\
+				   lds r31, %[skips]+3\n\
+				   adiw r30, 1\n\
+				   sts %[skips]+2, r30\n\
+				   sts %[skips]+3, r31\n\
+				2: lds r30, %[slice]\n\
+				   lds r31, %[slice]+1\n\
+				   lds r29, 0xb2\n\
+				3: tst r31\n\
+				   breq 4f\n\
+				   ldi r28, 0xff\n\
+				   subi r30, 0xff\n\
+				   sbci r31, 0\n\
+				   rjmp 5f\n\
+				4: mov r28, r30\n\
+				   clr r30\n\
+				5: add r29, r28\n\
+				   sts 0xb4, r29\n\
+				   sts %[left], r30\n\
+				   sts %[left]+1, r31\n\
+				   pop r28\n\
+				   pop r29\n\
+				   pop r31\n\
+				   pop r30\n\
+				   out 0x3f, r30\n\
+				   pop r30\n\
+				   reti\n"
+	
+				  // a different thread is scheduled, if the current thread is 
+				  // locked leave the preemption to unlock and stop the slice
+				  "1: lds r30, %[lock]\n\
+				   tst r30\n\
+				   breq 6f\n\
+				   ldi r30, 1\n\
+				   sts %[pending], r30\n\
+				   lds r30, 0x70\n\
+				   cbr r30, 1 << 2\n\
+				   sts 0x70, r30\n\
+				   pop r28\n\
+				   pop r29\n\
+				   pop r31\n\
+				   pop r30\n\
+				   out 0x3f, r30\n\
+				   pop r30\n\
+				   reti\n"
+	
+				  // otherwise invoke the scheduler at the save context entry 
+				  // point
+				  "6: pop r28\n\
+				   pop r29\n\
+				   pop r31\n\
+				   pop r30\n\
+				   out 0x3f, r30\n\
+				   pop r30\n\
+				   rjmp save_context"
+				  :
+				  : [left] "i" (&kernel_data.schedule_ctrl.slice_left),
+				    [grp] "i" (&kernel_data.schedule_ctrl.ready_grp),
+				    [hi_msk] "i" (&kernel_data.schedule_ctrl.cur_hi_msk),
+				    [prio] "i" (&kernel_data.schedule_ctrl.cur_prio),
+				    [tbl] "i" (kernel_data.schedule_ctrl.ready_tbl),
+				    [msk] "i" (&kernel_data.schedule_ctrl.cur_thread_msk),
+				    [bytes] "n" (sizeof(thread_msk_t)),
+				    [slice] "i" (&kernel_data.schedule_ctrl.cur_slice),
+				    [skips] "i" (&kernel_data.schedule_ctrl.switch_skips),
+				    [lock] "i" (&kernel_data.schedule_ctrl.lock_cnt),
+				    [pending] "i" (&kernel_data.schedule_ctrl.preempt_pending));
 }
 
 /****************************************************************************
@@ -81,52 +189,177 @@ void init_system_timer()
 	uint8_t cs2 = PRESCALLER_SELECT;	// use prescaller selected dynamically 
 										// at compile time
 	uint8_t ocie2a = 0b1;				// enable compare match A interrupt
-	uint8_t ocie2b = 0b1;				// enable compare match b interrupt
+	uint8_t ocie2b = 0b0;				// compare match b interrupt is enabled 
+										// by thread 0's time slice
 	uint8_t toie2 = 0b0;				// disable overflow interrupt
 	
 	TCCR2A = (com2a << COM2A0) | (com2b << COM2B0) | ((wgm2 & 0b11) << WGM20);
 	TCCR2B = (foc2a << FOC2A) | (foc2b << FOC2B) 
 		   | (((wgm2 & 0b100) >> 2) << WGM22) | (cs2 << CS20);
-	OCR2A = (uint8_t) ((F_CPU / USEC_PER_MILLIS) / TIMER2_PRESCALLER - 1);
-	OCR2B = (uint8_t) (TIME_SLICE / TIMER2_PRESCALLER - 1);
 	TIMSK2 = (ocie2a << OCIE2A) | (ocie2b << OCIE2B) | (toie2 << TOIE2);
 	
 	// set timer to zero
+	TCNT2 = 0;
+	kernel_data.timer_last = 0;
+	kernel_data.system_time_us = 0;
 	kernel_data.system_time = 0;
+	program_system_timer();
+	
+	if (!kernel_data.thread_ctrl_tbl[THREAD0].cooperative)
+	{
+		start_slice();
+	}
 }
 
 /*
- *	Delays the current thread and invokes the scheduler.
+ *	Delays the current thread by at least the given number of milliseconds 
+ *	and invokes the scheduler.
+ *
+ *	delay_millis:	the minimum number of milliseconds for the thread to be 
+ *	delayed
  */
 void delay(uint16_t delay_millis)
 {
 	// atomically set the delay counter and set the delay status bit.
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		kernel_data.schedule_ctrl.delay_ctrs[kernel_data.schedule_ctrl.cur_thread_id] = 
-			delay_millis;
 		kernel_data.schedule_ctrl.delay_status |= 
 			kernel_data.schedule_ctrl.cur_thread_msk;
+		update_ready(kernel_data.schedule_ctrl.cur_thread_id);
+		update_system_time();
+		wake_insert(kernel_data.schedule_ctrl.cur_thread_id, 
+					kernel_data.system_time + delay_millis);
+	}
+	yield();
+}
+
+/*
+ *	Gives up the rest of the current time slice and invokes the scheduler, 
+ *	saving only a call context. Returns immediately if the current thread 
+ *	would be scheduled again. Must not be called with interrupts disabled, 
+ *	the interrupt is enabled when this function returns.
+ */
+void __attribute__ ((naked)) yield()
+{
+	// only caller save registers are used before the context is saved
+	cli();
+	if (!switch_needed())
+	{
+		sei();
+		asm volatile ("ret");
 	}
-	asm volatile ("jmp save_context");
+	asm volatile ("jmp save_call_context");
 }
 
 /*
- *	Locks the current thread preventing the scheduler from being invoked.
+ *	Hands the processor directly to the given thread, regardless of 
+ *	priority, without waiting for the time slice to expire. If the thread 
+ *	is not ready the scheduler selects the next thread as it would at the 
+ *	end of the time slice.
+ *
+ *	tid:	thread id of the thread to run next
+ */
+void yield_to(uint8_t tid)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		kernel_data.schedule_ctrl.yield_tid = tid;
+	}
+	yield();
+}
+
+/*
+ *	Locks the current thread preventing it from being preempted, at the 
+ *	end of its time slice or by a thread it wakes. Locks nest, the thread 
+ *	is preemptible again after the matching number of unlocks. The lock 
+ *	belongs to the thread and is kept while it delays or blocks.
  */
 void lock()
 {
-	// clear the timer compare match B interrupt mask
-	TIMSK2 &= ~(0b1 << OCIE2B);
+	// only the current thread changes its count and the ISR only reads it
+	++kernel_data.schedule_ctrl.lock_cnt;
 }
 
 /*
- *	Unlock the thread to allow the scheduler to be invoked preemptively.
+ *	Releases one level of lock. The outermost unlock invokes the scheduler 
+ *	at once if the thread would have been preempted while locked. Must not 
+ *	be called with interrupts disabled.
  */
 void unlock()
 {
-	// set the timer compare match B interrupt mask
-	TIMSK2 |= (0b1 << OCIE2B);
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (!kernel_data.schedule_ctrl.lock_cnt 
+		 || --kernel_data.schedule_ctrl.lock_cnt
+		 || !kernel_data.schedule_ctrl.preempt_pending)
+		{
+			return;
+		}
+		kernel_data.schedule_ctrl.preempt_pending = false;
+		// the slice was stopped when it ended, start a new one in case the 
+		// thread is scheduled again
+		if (!kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].cooperative)
+		{
+			start_slice();
+		}
+	}
+	yield();
+}
+
+/*
+ *	Sets whether a thread is cooperative. A cooperative thread is never 
+ *	preempted at the end of a time slice, it runs until it yields, delays 
+ *	or blocks. Threads are preemptible unless set otherwise, the setting 
+ *	is kept when the thread is recreated with new.
+ *
+ *	tid:			thread id of the thread
+ *	cooperative:	true if the thread is cooperative
+ */
+void set_cooperative(uint8_t tid, bool cooperative)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		kernel_data.thread_ctrl_tbl[tid].cooperative = cooperative;
+		if (kernel_data.schedule_ctrl.cur_thread_id == tid)
+		{
+			if (cooperative)
+			{
+				TIMSK2 &= ~(0b1 << OCIE2B);
+			}
+			else
+			{
+				start_slice();
+			}
+		}
+	}
+}
+
+/*
+ *	Sets the length of a thread's time slice, so threads of equal priority 
+ *	share the processor in proportion to their slices. Takes effect at the 
+ *	start of the thread's next slice. Threads use TIME_SLICE unless set 
+ *	otherwise, the setting is kept when the thread is recreated with new.
+ *
+ *	tid:		thread id of the thread
+ *	cycles:		length of the time slice in CPU cycles, 2 to 0x10000 timer 
+ *				2 counts, clamped to that range
+ */
+void set_time_slice(uint8_t tid, uint32_t cycles)
+{
+	uint32_t counts = cycles / TIMER2_PRESCALLER;
+	// counts are stored less one as TIME_SLICE's are, and 0 is the default
+	if (counts < 2)
+	{
+		counts = 2;
+	}
+	else if (counts > 0x10000)
+	{
+		counts = 0x10000;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		kernel_data.thread_ctrl_tbl[tid].time_slice = counts - 1;
+	}
 }
 
 
@@ -179,9 +412,54 @@ void __attribute__ ((naked)) save_context()
 	asm volatile ("in r0, 0x3f\n\
 				   push r0");
 	
+	// the interrupted code may hold any value in r1, the scheduler 
+	// requires it to be zero
+	asm volatile ("clr r1");
+	
 	//	save stack pointer		   
 	kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].stack_ptr = 
 		*STACK_POINTER;
+	kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].full_context = 
+		true;
+	
+	// jump to the scheduler
+	asm volatile ("rjmp schedule");
+}
+
+/*
+ *	Saves the context of a thread that called into the scheduler, only the 
+ *	callee save registers need to be kept across the call. Must be entered 
+ *	with interrupts disabled.
+ *	This function enters scheduler after completion.
+ */
+void __attribute__ ((naked)) save_call_context()
+{
+	// push all callee save registers to stack
+	// any caller save registers should already be saved
+	asm volatile ("push r2\n\
+				   push r3\n\
+				   push r4\n\
+				   push r5\n\
+				   push r6\n\
+				   push r7\n\
+				   push r8\n\
+				   push r9\n\
+				   push r10\n\
+				   push r11\n\
+				   push r12\n\
+				   push r13\n\
+				   push r14\n\
+				   push r15\n\
+				   push r16\n\
+				   push r17\n\
+				   push r28\n\
+				   push r29");
+	
+	//	save stack pointer
+	kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].stack_ptr = 
+		*STACK_POINTER;
+	kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].full_context = 
+		false;
 	
 	// jump to the scheduler
 	asm volatile ("rjmp schedule");
@@ -193,12 +471,6 @@ void __attribute__ ((naked)) save_context()
  */
 void __attribute__ ((naked)) restore_context()
 {
-	// increment OCR2B to match on at the end of the next time slice
-	OCR2B = TCNT2 + (TIME_SLICE / TIMER2_PRESCALLER - 1);
-	
-	// enable the TIMER2_COMPB interrupt to allow for rescheduling
-	TIMSK2 |= 0b1<<OCIE2B;
-	
 	// restore stack pointer
 	*STACK_POINTER = 
 		kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].stack_ptr;
@@ -247,7 +519,42 @@ void __attribute__ ((naked)) restore_context()
 }
 
 /*
- *	Verifies the stack canary and schedulers the next thread.
+ *	Restores the call context of the current thread and returns from its 
+ *	call into the scheduler with interrupts enabled.
+ *	Is invoked after the scheduler runs.
+ */
+void __attribute__ ((naked)) restore_call_context()
+{
+	// restore stack pointer
+	*STACK_POINTER = 
+		kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].stack_ptr;
+	
+	asm volatile ("pop r29\n\
+				   pop r28\n\
+				   pop r17\n\
+				   pop r16\n\
+				   pop r15\n\
+				   pop r14\n\
+				   pop r13\n\
+				   pop r12\n\
+				   pop r11\n\
+				   pop r10\n\
+				   pop r9\n\
+				   pop r8\n\
+				   pop r7\n\
+				   pop r6\n\
+				   pop r5\n\
+				   pop r4\n\
+				   pop r3\n\
+				   pop r2");
+	
+	// return to the caller of the scheduler, enabling the interrupt
+	asm volatile ("reti");
+}
+
+/*
+ *	Verifies the stack canary and schedules the highest priority ready 
+ *	thread, round robin among threads of equal priority.
  *	If no thread is enabled, the scheduler enters a sleep mode.
  */
 void __attribute__ ((naked)) schedule()
@@ -262,37 +569,72 @@ void __attribute__ ((naked)) schedule()
 		stack_overflow();
 	}
 	
-	// compute ready status and sleep if no threads are ready
-	uint8_t ready_status;
-	do
+	// the context is saved, run the rest of the scheduler on its own stack
+	*STACK_POINTER = kernel_data.isr_stack_top;
+	if (*(uint8_t *) ISR_STACK_BOTTOM != CANARY)
 	{
-		ready_status = kernel_data.schedule_ctrl.disable_status;
-		ready_status |= kernel_data.schedule_ctrl.delay_status;
-		ready_status = ~ready_status;
-		if (!ready_status)
-		{
-			// enter the extended standby sleep mode if no threads are ready
-			SMCR = SLEEP_MODE_EXT_STANDBY | (0b1 << SE);
-			sei();
-			asm volatile ("sleep");
-			cli();
-		}
-	} while (!ready_status);
+		stack_overflow();
+	}
+	
+	// keep the lock with the thread
+	kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].lock_cnt = 
+		kernel_data.schedule_ctrl.lock_cnt;
+	
+	// select the next thread and sleep if no threads are ready
+	while (!select_thread())
+	{
+		// enter the deepest sleep mode that meets the next wakeup
+		SMCR = select_sleep_mode() | (0b1 << SE);
+		sei();
+		asm volatile ("sleep");
+		cli();
+	}
+	kernel_data.schedule_ctrl.lock_cnt = 
+		kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].lock_cnt;
+	// pending preemptions happen now, including any requested by ISRs 
+	// taken while sleeping
+	kernel_data.schedule_ctrl.preempt_pending = false;
+	kernel_data.schedule_ctrl.isr_resched = false;
+	
+	// start the time slice of a preemptible thread, cooperative threads 
+	// run with the TIMER2_COMPB interrupt disabled
+	if (!kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].cooperative)
+	{
+		start_slice();
+	}
 	
-	// schedule the next thread
-	do
+	// jump to restore the new current thread's context, which depends on 
+	// how it entered the scheduler
+	if (kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].full_context)
 	{
-		kernel_data.schedule_ctrl.cur_thread_id = 
-			(kernel_data.schedule_ctrl.cur_thread_id + 1) & 0x07;
-		asm volatile ("lsl %1\n\
-					   clr r1\n\
-					   adc %1, r1"
-					   : "=r" (kernel_data.schedule_ctrl.cur_thread_msk)
-					   : "r" (kernel_data.schedule_ctrl.cur_thread_msk));
-	} while (!(kernel_data.schedule_ctrl.cur_thread_msk & ready_status));
+		asm volatile ("rjmp restore_context");
+	}
+	asm volatile ("rjmp restore_call_context");
+}
+
+/*
+ *	Starts a full time slice for the current thread and enables the 
+ *	TIMER2_COMPB interrupt. A slice longer than 0xff counts is armed in 
+ *	parts, the ISR arms the rest from slice_left.
+ */
+void start_slice()
+{
+	uint16_t slice = 
+		kernel_data.thread_ctrl_tbl[kernel_data.schedule_ctrl.cur_thread_id].time_slice;
+	if (!slice)
+	{
+		slice = SLICE_COUNTS(TIME_SLICE);
+	}
+	kernel_data.schedule_ctrl.cur_slice = slice;
 	
-	// jump to restore the new current thread's context
-	asm volatile ("rjmp restore_context");
+	uint8_t counts = slice > 0xff ? 0xff : slice;
+	kernel_data.schedule_ctrl.slice_left = slice - counts;
+	// increment OCR2B to match on at the end of the slice, or its first part
+	OCR2B = TCNT2 + counts;
+	// a compare match while the slice was stopped must not end the new one
+	TIFR2 = 0b1<<OCF2B;
+	// enable the TIMER2_COMPB interrupt to allow for rescheduling
+	TIMSK2 |= 0b1<<OCIE2B;
 }
 
 #endif /* PREEMPTIVE */
\ No newline at end of file
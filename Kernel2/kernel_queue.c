@@ -0,0 +1,176 @@
+/*
+ * kernel_queue.c
+ *
+ * Message queues that pass pointers between threads. A sender fills a 
+ * block, usually taken from a pool, and sends the pointer, handing the 
+ * block to the receiver without copying it. Receivers block on an empty 
+ * queue and senders on a full one, either with a timeout.
+ */
+
+#include "kernel.h"
+
+/****************************************************************************
+*	External function declarations
+****************************************************************************/
+
+extern uint8_t top_waiter(thread_msk_t waiters);
+extern void wait_block(thread_msk_t *waiters, uint16_t timeout);
+extern bool wait_result();
+extern void wait_wake(uint8_t tid);
+extern void wake_yield();
+
+/****************************************************************************
+*	Message queue function definitions
+****************************************************************************/
+
+/*
+ *	Initializes an empty queue. Queues can also be initialized with 
+ *	QUEUE_INITIALIZER.
+ *
+ *	queue:	the queue
+ *	buf:	storage for the message pointers
+ *	size:	the number of pointers buf holds
+ */
+void queue_init(queue_struct *queue, void **buf, uint8_t size)
+{
+	queue->buf = buf;
+	queue->size = size;
+	queue->head = 0;
+	queue->count = 0;
+	queue->senders = 0;
+	queue->receivers = 0;
+}
+
+/*
+ *	Sends a message, blocking the current thread while the queue is full 
+ *	until the timeout passes. A waiting receiver is handed the message 
+ *	directly. The receiver owns the message once it is sent. May be called 
+ *	from a KERNEL_ISR if timeout is NO_WAIT.
+ *
+ *	queue:		the queue
+ *	msg:		the message
+ *	timeout:	milliseconds to wait, NO_WAIT or WAIT_FOREVER
+ *	returns:	true if the message was sent, false if the wait timed out
+ */
+bool queue_send(queue_struct *queue, void *msg, uint16_t timeout)
+{
+	bool blocked = false;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (queue->receivers)
+		{
+			// receivers only wait on an empty queue
+			uint8_t tid = top_waiter(queue->receivers);
+			kernel_data.thread_ctrl_tbl[tid].wait_msg = msg;
+			wait_wake(tid);
+		}
+		else if (queue->count < queue->size)
+		{
+			uint8_t tail = queue->head + queue->count;
+			if (tail >= queue->size)
+			{
+				tail -= queue->size;
+			}
+			queue->buf[tail] = msg;
+			++queue->count;
+			return true;
+		}
+		else if (timeout == NO_WAIT)
+		{
+			return false;
+		}
+		else
+		{
+			uint8_t tid = kernel_data.schedule_ctrl.cur_thread_id;
+			kernel_data.thread_ctrl_tbl[tid].wait_msg = msg;
+			wait_block(&queue->senders, timeout);
+			blocked = true;
+		}
+	}
+	// a receiver was woken or this thread blocked
+	if (blocked)
+	{
+		yield();
+		// a receiver moves the message into the queue when it wakes 
+		// this thread
+		return wait_result();
+	}
+	wake_yield();
+	return true;
+}
+
+/*
+ *	Receives the oldest message, blocking the current thread while the 
+ *	queue is empty until the timeout passes. May be called from a 
+ *	KERNEL_ISR if timeout is NO_WAIT.
+ *
+ *	queue:		the queue
+ *	timeout:	milliseconds to wait, NO_WAIT or WAIT_FOREVER
+ *	returns:	the message, NULL if the wait timed out
+ */
+void *queue_receive(queue_struct *queue, uint16_t timeout)
+{
+	void *msg = NULL;
+	bool blocked = false;
+	uint8_t tid = kernel_data.schedule_ctrl.cur_thread_id;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (!queue->count)
+		{
+			if (timeout == NO_WAIT)
+			{
+				return NULL;
+			}
+			wait_block(&queue->receivers, timeout);
+			blocked = true;
+		}
+		else
+		{
+			msg = queue->buf[queue->head];
+			if (++queue->head == queue->size)
+			{
+				queue->head = 0;
+			}
+			--queue->count;
+			
+			if (!queue->senders)
+			{
+				return msg;
+			}
+			// the queue was full, move the top sender's message into the 
+			// slot just freed
+			uint8_t sender = top_waiter(queue->senders);
+			uint8_t tail = queue->head + queue->count;
+			if (tail >= queue->size)
+			{
+				tail -= queue->size;
+			}
+			queue->buf[tail] = kernel_data.thread_ctrl_tbl[sender].wait_msg;
+			++queue->count;
+			wait_wake(sender);
+		}
+	}
+	
+	if (blocked)
+	{
+		yield();
+		// a sender hands its message straight to the woken thread
+		if (!wait_result())
+		{
+			return NULL;
+		}
+		return kernel_data.thread_ctrl_tbl[tid].wait_msg;
+	}
+	wake_yield();
+	return msg;
+}
+
+/*
+ *	Returns the number of messages in a queue.
+ *
+ *	queue:	the queue
+ */
+uint8_t queue_count(queue_struct *queue)
+{
+	return queue->count;
+}
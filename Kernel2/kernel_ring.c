@@ -0,0 +1,198 @@
+/*
+ * kernel_ring.c
+ *
+ * Single producer, single consumer byte ring buffers for passing data from
+ * an ISR to a thread, or between two threads. Each side only writes its 
+ * own index, so data moves without disabling interrupts. The consumer can 
+ * block until data arrives.
+ */
+
+#include "kernel.h"
+
+/****************************************************************************
+*	External function declarations
+****************************************************************************/
+
+extern uint8_t msk_to_tid(thread_msk_t msk);
+extern void wait_block(thread_msk_t *waiters, uint16_t timeout);
+extern bool wait_result();
+extern void wait_wake(uint8_t tid);
+extern void wake_yield();
+
+/****************************************************************************
+*	Local function declarations
+****************************************************************************/
+
+void ring_wake(ring_struct *ring);
+
+/****************************************************************************
+*	Ring buffer function definitions
+****************************************************************************/
+
+/*
+ *	Initializes an empty ring buffer. Ring buffers can also be initialized 
+ *	with RING_INITIALIZER.
+ *
+ *	ring:	the ring buffer
+ *	buf:	the storage for the data
+ *	size:	the size of buf, a power of 2 no larger than 128
+ */
+void ring_init(ring_struct *ring, uint8_t *buf, uint8_t size)
+{
+	ring->buf = buf;
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->waiters = 0;
+}
+
+/*
+ *	Writes as many bytes as fit into a ring buffer without blocking. Only 
+ *	the producer may call this. May be called from a KERNEL_ISR.
+ *
+ *	ring:		the ring buffer
+ *	data:		the bytes to write
+ *	len:		the number of bytes to write
+ *	returns:	the number of bytes written
+ */
+uint8_t ring_write(ring_struct *ring, const uint8_t *data, uint8_t len)
+{
+	uint8_t head = ring->head;
+	uint8_t space = ring->mask + 1 - (uint8_t) (head - ring->tail);
+	if (len > space)
+	{
+		len = space;
+	}
+	for (uint8_t i = 0; i < len; ++i)
+	{
+		ring->buf[head++ & ring->mask] = data[i];
+	}
+	// the data must be in the buffer before the consumer can see it
+	asm volatile ("" ::: "memory");
+	ring->head = head;
+	// and head must be stored before waiters is read, or a consumer that 
+	// saw the old head could block after the producer found no waiter
+	asm volatile ("" ::: "memory");
+	
+	if (len && ring->waiters)
+	{
+		ring_wake(ring);
+	}
+	return len;
+}
+
+/*
+ *	Writes one byte into a ring buffer without blocking. Only the producer 
+ *	may call this. May be called from a KERNEL_ISR.
+ *
+ *	ring:		the ring buffer
+ *	data:		the byte to write
+ *	returns:	true if the byte was written, false if the buffer was full
+ */
+bool ring_put(ring_struct *ring, uint8_t data)
+{
+	return ring_write(ring, &data, 1);
+}
+
+/*
+ *	Reads up to len bytes from a ring buffer, blocking the current thread 
+ *	until at least one byte is available or the timeout passes. Only the 
+ *	consumer may call this and it must not be called from an ISR unless 
+ *	timeout is NO_WAIT.
+ *
+ *	ring:		the ring buffer
+ *	data:		the buffer to read into
+ *	len:		the most bytes to read
+ *	timeout:	milliseconds to wait, NO_WAIT or WAIT_FOREVER
+ *	returns:	the number of bytes read, 0 if the wait timed out
+ */
+uint8_t ring_read(ring_struct *ring, uint8_t *data, uint8_t len, 
+				  uint16_t timeout)
+{
+	uint8_t tail = ring->tail;
+	if (ring->head == tail && timeout != NO_WAIT)
+	{
+		// checked again with interrupts disabled so a write between the 
+		// test and blocking is not missed
+		bool blocked = false;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if (ring->head == tail)
+			{
+				wait_block(&ring->waiters, timeout);
+				blocked = true;
+			}
+		}
+		if (blocked)
+		{
+			yield();
+			if (!wait_result())
+			{
+				return 0;
+			}
+		}
+	}
+	
+	uint8_t count = ring->head - tail;
+	if (len > count)
+	{
+		len = count;
+	}
+	// the data must not be read before head is
+	asm volatile ("" ::: "memory");
+	for (uint8_t i = 0; i < len; ++i)
+	{
+		data[i] = ring->buf[tail++ & ring->mask];
+	}
+	asm volatile ("" ::: "memory");
+	ring->tail = tail;
+	return len;
+}
+
+/*
+ *	Reads one byte from a ring buffer, blocking the current thread until it 
+ *	is available or the timeout passes. Only the consumer may call this.
+ *
+ *	ring:		the ring buffer
+ *	data:		where to store the byte
+ *	timeout:	milliseconds to wait, NO_WAIT or WAIT_FOREVER
+ *	returns:	true if a byte was read, false if the wait timed out
+ */
+bool ring_get(ring_struct *ring, uint8_t *data, uint16_t timeout)
+{
+	return ring_read(ring, data, 1, timeout);
+}
+
+/*
+ *	Returns the number of bytes in a ring buffer.
+ *
+ *	ring:	the ring buffer
+ */
+uint8_t ring_count(ring_struct *ring)
+{
+	return ring->head - ring->tail;
+}
+
+/****************************************************************************
+*	Local function definitions
+****************************************************************************/
+
+/*
+ *	Wakes the consumer blocked on a ring buffer. Only called once the 
+ *	producer has seen a waiter, so writes to a buffer whose consumer is 
+ *	not blocked never disable interrupts.
+ *
+ *	ring:	the ring buffer
+ */
+void ring_wake(ring_struct *ring)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		// the wait may have timed out since the producer looked
+		if (ring->waiters)
+		{
+			wait_wake(msk_to_tid(ring->waiters));
+		}
+	}
+	wake_yield();
+}
@@ -0,0 +1,102 @@
+/*
+ * kernel_sem.c
+ *
+ * Counting semaphores. Waiting threads block until a post or a timeout,
+ * and posts can be made from KERNEL_ISRs.
+ */
+
+#include "kernel.h"
+
+/****************************************************************************
+*	External function declarations
+****************************************************************************/
+
+extern uint8_t top_waiter(thread_msk_t waiters);
+extern void wait_block(thread_msk_t *waiters, uint16_t timeout);
+extern bool wait_result();
+extern void wait_wake(uint8_t tid);
+extern void wake_yield();
+
+/****************************************************************************
+*	Semaphore function definitions
+****************************************************************************/
+
+/*
+ *	Initializes a semaphore with no waiting threads. Semaphores can also be
+ *	initialized with SEM_INITIALIZER.
+ *
+ *	sem:	the semaphore
+ *	count:	the initial count
+ */
+void sem_init(sem_struct *sem, uint16_t count)
+{
+	sem->count = count;
+	sem->waiters = 0;
+}
+
+/*
+ *	Takes one count from a semaphore, blocking the current thread until a
+ *	count is posted or the timeout passes. Must not be called from an ISR.
+ *
+ *	sem:		the semaphore
+ *	timeout:	milliseconds to wait, NO_WAIT or WAIT_FOREVER
+ *	returns:	true if a count was taken, false if the wait timed out
+ */
+bool sem_wait(sem_struct *sem, uint16_t timeout)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (sem->count)
+		{
+			--sem->count;
+			return true;
+		}
+		if (timeout == NO_WAIT)
+		{
+			return false;
+		}
+		wait_block(&sem->waiters, timeout);
+	}
+	yield();
+	// a post hands its count straight to the woken thread
+	return wait_result();
+}
+
+/*
+ *	Posts one count to a semaphore. The count is handed to the highest
+ *	priority waiting thread if there is one, which runs at once if its
+ *	priority is higher than the current thread's. May be called from a
+ *	KERNEL_ISR.
+ *
+ *	sem:	the semaphore
+ */
+void sem_post(sem_struct *sem)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (sem->waiters)
+		{
+			wait_wake(top_waiter(sem->waiters));
+		}
+		else
+		{
+			++sem->count;
+		}
+	}
+	wake_yield();
+}
+
+/*
+ *	Returns the current count of a semaphore.
+ *
+ *	sem:	the semaphore
+ */
+uint16_t sem_count(sem_struct *sem)
+{
+	uint16_t count;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		count = sem->count;
+	}
+	return count;
+}
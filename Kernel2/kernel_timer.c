@@ -0,0 +1,233 @@
+/*
+ * kernel_timer.c
+ *
+ * Software timers. Active timers are kept in expiry order and the timer 
+ * thread, TIMER_THREAD, delays on the kernel wakeup list until the first 
+ * one expires, then runs its callback. One shot and periodic timers share 
+ * the thread instead of each needing a thread in delay.
+ */
+
+#include "kernel.h"
+
+#ifdef TIMER_THREAD
+
+/****************************************************************************
+*	External function declarations
+****************************************************************************/
+
+extern void update_ready(uint8_t tid);
+extern thread_msk_t tid_to_msk(uint8_t tid);
+extern void update_system_time();
+extern void wake_insert(uint8_t tid, uint32_t wake_time);
+extern void wake_remove(uint8_t tid);
+extern void wake_yield();
+
+/****************************************************************************
+*	Local function declarations
+****************************************************************************/
+
+void timer_insert(timer_struct *timer);
+void timer_remove(timer_struct *timer);
+void timer_kick();
+
+/****************************************************************************
+*	Software timer function definitions
+****************************************************************************/
+
+/*
+ *	Initializes a stopped timer. Timers can also be initialized with 
+ *	TIMER_INITIALIZER.
+ *
+ *	timer:		the timer
+ *	callback:	function TIMER_THREAD runs when the timer expires
+ *	arg:		argument passed to the callback
+ */
+void timer_init(timer_struct *timer, PCALLBACK callback, void *arg)
+{
+	timer->next = NULL;
+	timer->expiry = 0;
+	timer->period = 0;
+	timer->active = false;
+	timer->callback = callback;
+	timer->arg = arg;
+}
+
+/*
+ *	Starts a timer, restarting it if it is already active. A periodic timer 
+ *	expires every period milliseconds after the first expiry, measured from 
+ *	when it was due rather than when its callback ran so it does not drift. 
+ *	May be called from a KERNEL_ISR.
+ *
+ *	timer:	the timer
+ *	delay:	milliseconds until the first expiry
+ *	period:	milliseconds between later expiries, 0 for a one shot timer
+ */
+void timer_start(timer_struct *timer, uint16_t delay, uint16_t period)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (timer->active)
+		{
+			timer_remove(timer);
+		}
+		update_system_time();
+		timer->expiry = kernel_data.system_time + delay;
+		timer->period = period;
+		timer->active = true;
+		timer_insert(timer);
+		
+		// the timer thread sleeps until the old first timer
+		if (kernel_data.timer_head == timer)
+		{
+			timer_kick();
+		}
+	}
+	wake_yield();
+}
+
+/*
+ *	Stops a timer. A callback already being run is not affected. May be 
+ *	called from a KERNEL_ISR.
+ *
+ *	timer:		the timer
+ *	returns:	true if the timer was active
+ */
+bool timer_stop(timer_struct *timer)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (!timer->active)
+		{
+			return false;
+		}
+		// the timer thread wakes for nothing if this was the first timer, 
+		// which is cheaper than moving its wakeup
+		timer_remove(timer);
+		timer->active = false;
+	}
+	return true;
+}
+
+/*
+ *	Returns true if a timer is active.
+ *
+ *	timer:	the timer
+ */
+bool timer_active(timer_struct *timer)
+{
+	return timer->active;
+}
+
+/****************************************************************************
+*	Kernel function definitions
+****************************************************************************/
+
+/*
+ *	Entry point of TIMER_THREAD. Runs the callback of each timer as it 
+ *	expires and otherwise delays until the first timer expires, or blocks 
+ *	if no timer is active.
+ */
+void timer_daemon()
+{
+	while (true)
+	{
+		timer_struct *timer = NULL;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			update_system_time();
+			timer_struct *first = kernel_data.timer_head;
+			if (!first)
+			{
+				kernel_data.schedule_ctrl.block_status |= 
+					kernel_data.schedule_ctrl.cur_thread_msk;
+			}
+			else if ((int32_t) (first->expiry - kernel_data.system_time) > 0)
+			{
+				kernel_data.schedule_ctrl.delay_status |= 
+					kernel_data.schedule_ctrl.cur_thread_msk;
+				wake_insert(TIMER_THREAD, first->expiry);
+			}
+			else
+			{
+				timer = first;
+				kernel_data.timer_head = timer->next;
+				if (timer->period)
+				{
+					timer->expiry += timer->period;
+					timer_insert(timer);
+				}
+				else
+				{
+					timer->active = false;
+				}
+			}
+			update_ready(TIMER_THREAD);
+		}
+		
+		if (timer)
+		{
+			timer->callback(timer->arg);
+		}
+		else
+		{
+			yield();
+		}
+	}
+}
+
+/****************************************************************************
+*	Local function definitions
+****************************************************************************/
+
+/*
+ *	Inserts a timer into the active list in expiry order, after timers 
+ *	that expire at the same time.
+ *	Must be called with interrupts disabled.
+ *
+ *	timer:	the timer
+ */
+void timer_insert(timer_struct *timer)
+{
+	timer_struct **link = &kernel_data.timer_head;
+	while (*link && (int32_t) ((*link)->expiry - timer->expiry) <= 0)
+	{
+		link = &(*link)->next;
+	}
+	timer->next = *link;
+	*link = timer;
+}
+
+/*
+ *	Removes a timer from the active list.
+ *	Must be called with interrupts disabled.
+ *
+ *	timer:	the timer, which must be active
+ */
+void timer_remove(timer_struct *timer)
+{
+	timer_struct **link = &kernel_data.timer_head;
+	while (*link != timer)
+	{
+		link = &(*link)->next;
+	}
+	*link = timer->next;
+}
+
+/*
+ *	Makes the timer thread ready so it finds the new first timer, cutting 
+ *	its delay or block short.
+ *	Must be called with interrupts disabled.
+ */
+void timer_kick()
+{
+	thread_msk_t msk = tid_to_msk(TIMER_THREAD);
+	if (kernel_data.schedule_ctrl.delay_status & msk)
+	{
+		wake_remove(TIMER_THREAD);
+		kernel_data.schedule_ctrl.delay_status &= ~msk;
+	}
+	kernel_data.schedule_ctrl.block_status &= ~msk;
+	update_ready(TIMER_THREAD);
+}
+
+#endif /* TIMER_THREAD */
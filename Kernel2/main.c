@@ -13,6 +13,113 @@
 #include "kernel.h"
 
 
+#ifdef BENCHMARK
+
+/*
+ *	Benchmark of the context switch and system timer costs with all 
+ *	MAX_THREADS threads created. Build with BENCHMARK defined once for each 
+ *	MAX_THREADS and read the results below with the debugger. Both costs 
+ *	are in CPU cycles counted by timer 1.
+ *
+ *	bench_switch_min/max:	yield_to from thread 0 until thread 1 runs
+ *	bench_tick_max:			longest gap seen by a busy thread, the cost of 
+ *							the longest ISR including the system timer tick
+ *
+ *	No results have been measured on hardware yet. The cycles for 8, 16 
+ *	and 32 threads belong here once the benchmark has been run. Selecting 
+ *	a thread scans one byte of a thread mask per 8 threads, so the switch 
+ *	cost is expected to grow by a few cycles per byte rather than stay 
+ *	flat. Delaying or waiting with a timeout walks the wakeup list and 
+ *	picking a waiter walks the waiters, both linear in the threads involved.
+ */
+
+volatile uint16_t bench_start;
+volatile uint16_t bench_switch_min = 0xffff;
+volatile uint16_t bench_switch_max;
+volatile uint16_t bench_tick_max;
+volatile bool bench_timing;
+volatile bool bench_done;
+
+// parks every other thread on the wakeup list
+void bench_idle()
+{
+	while(1)
+	{
+		delay(60000);
+	}
+}
+
+void bench_pong()
+{
+	while(1)
+	{
+		// only a switch started by thread 0 is a sample, pong also runs 
+		// while thread 0 is delayed at startup
+		uint16_t cycles = TCNT1 - bench_start;
+		if (bench_timing)
+		{
+			bench_timing = false;
+			if (cycles < bench_switch_min)
+			{
+				bench_switch_min = cycles;
+			}
+			if (cycles > bench_switch_max)
+			{
+				bench_switch_max = cycles;
+			}
+		}
+		
+		if (bench_done)
+		{
+			delay(60000);
+		}
+		yield_to(THREAD0);
+	}
+}
+
+int main(void)
+{
+	init();
+	
+	// run timer 1 at the CPU clock
+	TCCR1A = 0x00;
+	TCCR1B = 0b001 << CS10;
+	
+	for (uint8_t tid = THREAD2; tid < MAX_THREADS; ++tid)
+	{
+		new(tid, bench_idle, true);
+	}
+	new(THREAD1, bench_pong, true);
+	// let the idle threads park themselves
+	delay(1);
+	
+	for (uint16_t i = 0; i < 1000; ++i)
+	{
+		bench_timing = true;
+		bench_start = TCNT1;
+		yield_to(THREAD1);
+	}
+	bench_done = true;
+	yield_to(THREAD1);
+	
+	// with every other thread delayed, any gap between two reads of timer 1 
+	// is time spent in an ISR
+	uint16_t last = TCNT1;
+	for (uint32_t i = 0; i < 100000; ++i)
+	{
+		uint16_t now = TCNT1;
+		if ((uint16_t) (now - last) > bench_tick_max)
+		{
+			bench_tick_max = now - last;
+		}
+		last = now;
+	}
+	
+	while(1);
+}
+
+#else /* BENCHMARK */
+
 void t0()
 {
 	while(1)
@@ -50,3 +157,4 @@ int main(void)
 	new(0, t0, true);
 }
 
+#endif /* BENCHMARK */